@@ -1,47 +1,67 @@
 #pragma once
 
+#include <algorithm>
 #include <cstddef>
 #include <memory>
+#include <memory_resource>
+#include <new>
 #include <utility>
+#include <vector>
 
+#include <sys/mman.h>
+
+// Bump allocator over a chain of blocks. When the current block is full a
+// new one twice the size of the previous is chained on, so allocation never
+// fails short of the system running out of memory. reset() rewinds to the
+// first block and keeps every block for reuse by the next compilation.
 class ArenaAllocator {
 public:
-	explicit ArenaAllocator(const size_t max_num_bytes)
-		: m_size { max_num_bytes }
-		, m_buffer { new std::byte[max_num_bytes] }
-		, m_offset { m_buffer }
+	struct Stats {
+		size_t bytes_used = 0; // including alignment padding
+		size_t bytes_reserved = 0;
+		size_t padding_bytes = 0;
+		size_t blocks = 0;
+		size_t high_water_mark = 0; // largest bytes_used seen across resets
+	};
+
+	static constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+	explicit ArenaAllocator(const size_t initial_num_bytes, const bool huge_pages = false)
+		: m_huge_pages { huge_pages }
 	{
+		add_block(initial_num_bytes);
 	}
 
 	ArenaAllocator(const ArenaAllocator&) = delete;
 	ArenaAllocator& operator=(const ArenaAllocator&) = delete;
 
 	ArenaAllocator(ArenaAllocator&& other) noexcept
-		: m_size { std::exchange(other.m_size, 0) }
-		, m_buffer { std::exchange(other.m_buffer, nullptr) }
+		: m_blocks { std::exchange(other.m_blocks, {}) }
+		, m_current { std::exchange(other.m_current, 0) }
 		, m_offset { std::exchange(other.m_offset, nullptr) }
+		, m_huge_pages { other.m_huge_pages }
+		, m_used_before_current { std::exchange(other.m_used_before_current, 0) }
+		, m_padding { std::exchange(other.m_padding, 0) }
+		, m_high_water_mark { std::exchange(other.m_high_water_mark, 0) }
 	{
 	}
 
 	ArenaAllocator& operator=(ArenaAllocator&& other) noexcept
 	{
-		std::swap(m_size, other.m_size);
-		std::swap(m_buffer, other.m_buffer);
+		std::swap(m_blocks, other.m_blocks);
+		std::swap(m_current, other.m_current);
 		std::swap(m_offset, other.m_offset);
+		std::swap(m_huge_pages, other.m_huge_pages);
+		std::swap(m_used_before_current, other.m_used_before_current);
+		std::swap(m_padding, other.m_padding);
+		std::swap(m_high_water_mark, other.m_high_water_mark);
 		return *this;
 	}
 
 	template <typename T>
 	[[nodiscard]] T* alloc()
 	{
-		size_t remaining_num_bytes = m_size - static_cast<size_t>(m_offset - m_buffer);
-		auto pointer = static_cast<void*>(m_offset);
-		const auto aligned_address = std::align(alignof(T), sizeof(T), pointer, remaining_num_bytes);
-		if (aligned_address == nullptr) {
-			throw std::bad_alloc {};
-		}
-		m_offset = static_cast<std::byte*>(aligned_address) + sizeof(T);
-		return static_cast<T*>(aligned_address);
+		return static_cast<T*>(alloc_bytes(sizeof(T), alignof(T)));
 	}
 
 	template <typename T, typename... Args>
@@ -51,13 +71,158 @@ public:
 		return new (allocated_memory) T { std::forward<Args>(args)... };
 	}
 
+	[[nodiscard]] void* alloc_bytes(const size_t num_bytes, const size_t alignment)
+	{
+		while (true) {
+			if (!m_blocks.empty()) {
+				const Block& block = m_blocks[m_current];
+				size_t remaining_num_bytes = block.size - static_cast<size_t>(m_offset - block.begin);
+				auto pointer = static_cast<void*>(m_offset);
+				if (std::align(alignment, num_bytes, pointer, remaining_num_bytes) != nullptr) {
+					m_padding += static_cast<size_t>(static_cast<std::byte*>(pointer) - m_offset);
+					m_offset = static_cast<std::byte*>(pointer) + num_bytes;
+					return pointer;
+				}
+			}
+			next_block(num_bytes + alignment);
+		}
+	}
+
+	// Forgets every allocation but keeps the blocks, so a reused arena does not
+	// have to grow again. Objects living in the arena are not destroyed.
+	void reset()
+	{
+		m_high_water_mark = std::max(m_high_water_mark, bytes_used());
+		if (m_blocks.empty()) {
+			return;
+		}
+		m_current = 0;
+		m_offset = m_blocks.front().begin;
+		m_used_before_current = 0;
+		m_padding = 0;
+	}
+
+	[[nodiscard]] Stats stats() const
+	{
+		Stats stats;
+		stats.bytes_used = bytes_used();
+		for (const Block& block : m_blocks) {
+			stats.bytes_reserved += block.size;
+		}
+		stats.padding_bytes = m_padding;
+		stats.blocks = m_blocks.size();
+		stats.high_water_mark = std::max(m_high_water_mark, stats.bytes_used);
+		return stats;
+	}
+
 	~ArenaAllocator()
 	{
-		delete[] m_buffer;
+		for (const Block& block : m_blocks) {
+			free_block(block);
+		}
 	}
 
 private:
-	size_t m_size;
-	std::byte* m_buffer;
-	std::byte* m_offset;
-};
\ No newline at end of file
+	struct Block {
+		std::byte* begin;
+		size_t size;
+		bool mapped;
+	};
+
+	[[nodiscard]] size_t bytes_used() const
+	{
+		if (m_blocks.empty()) {
+			return 0;
+		}
+		return m_used_before_current + static_cast<size_t>(m_offset - m_blocks[m_current].begin);
+	}
+
+	// Moves on to the next block that can hold min_num_bytes, reusing blocks
+	// kept by reset() before chaining on a new one. A moved-from arena has no
+	// blocks and starts a new chain.
+	void next_block(const size_t min_num_bytes)
+	{
+		if (m_blocks.empty()) {
+			add_block(min_num_bytes);
+			return;
+		}
+		m_used_before_current += static_cast<size_t>(m_offset - m_blocks[m_current].begin);
+		while (m_current + 1 < m_blocks.size()) {
+			m_current++;
+			m_offset = m_blocks[m_current].begin;
+			if (m_blocks[m_current].size >= min_num_bytes) {
+				return;
+			}
+		}
+		add_block(std::max(m_blocks.back().size * 2, min_num_bytes));
+	}
+
+	void add_block(size_t num_bytes)
+	{
+		Block block { nullptr, num_bytes, false };
+		if (m_huge_pages) {
+			num_bytes = (num_bytes + huge_page_size - 1) / huge_page_size * huge_page_size;
+			void* mapped = mmap(nullptr, num_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (mapped == MAP_FAILED) {
+				// No reserved huge pages; ask for transparent ones instead.
+				mapped = mmap(nullptr, num_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (mapped != MAP_FAILED) {
+					madvise(mapped, num_bytes, MADV_HUGEPAGE);
+				}
+			}
+			if (mapped != MAP_FAILED) {
+				block = Block { static_cast<std::byte*>(mapped), num_bytes, true };
+			}
+		}
+		if (block.begin == nullptr) {
+			block = Block { new std::byte[num_bytes], num_bytes, false };
+		}
+		m_blocks.push_back(block);
+		m_current = m_blocks.size() - 1;
+		m_offset = block.begin;
+	}
+
+	static void free_block(const Block& block)
+	{
+		if (block.mapped) {
+			munmap(block.begin, block.size);
+		} else {
+			delete[] block.begin;
+		}
+	}
+
+	std::vector<Block> m_blocks;
+	size_t m_current = 0;
+	std::byte* m_offset = nullptr;
+	bool m_huge_pages = false;
+	size_t m_used_before_current = 0;
+	size_t m_padding = 0;
+	size_t m_high_water_mark = 0;
+};
+
+// Lets std::pmr containers allocate from an ArenaAllocator. Deallocation is
+// a no-op; the memory is returned when the arena is reset or destroyed.
+class ArenaResource : public std::pmr::memory_resource {
+public:
+	explicit ArenaResource(ArenaAllocator& allocator)
+		: m_allocator { allocator }
+	{
+	}
+
+private:
+	void* do_allocate(const size_t num_bytes, const size_t alignment) override
+	{
+		return m_allocator.alloc_bytes(num_bytes, alignment);
+	}
+
+	void do_deallocate(void*, size_t, size_t) override
+	{
+	}
+
+	[[nodiscard]] bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+	{
+		return this == &other;
+	}
+
+	ArenaAllocator& m_allocator;
+};
@@ -0,0 +1,1040 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Assembler for the NASM subset the Generator emits: `global`, `section
+// .text/.data/.bss`, labels (including NASM `.local` labels), db/dw/dd/dq,
+// resb/resw/resd/resq, `equ` with `$` arithmetic, and the integer
+// instructions used by codegen. Output is position-dependent machine code
+// plus fixups, linked to fixed addresses by ObjectCode::link.
+enum class AsmSection : uint8_t {
+	text,
+	data,
+	bss
+};
+
+struct AsmSymbol {
+	enum class Kind : uint8_t {
+		label,
+		constant
+	} kind;
+	AsmSection section;
+	int64_t value; // section offset for labels, the value for constants
+};
+
+struct AsmFixup {
+	enum class Kind : uint8_t {
+		abs32,
+		abs64,
+		rel32
+	} kind;
+	AsmSection section; // where the patched bytes live (text or data)
+	size_t offset;
+	std::string symbol;
+	int64_t addend;
+};
+
+struct ObjectCode {
+	std::vector<uint8_t> text;
+	std::vector<uint8_t> data;
+	size_t bss_size = 0;
+	std::unordered_map<std::string, AsmSymbol> symbols;
+	std::vector<AsmFixup> fixups;
+
+	[[nodiscard]] uint64_t address_of(const AsmSymbol& symbol, const uint64_t text_base, const uint64_t data_base) const {
+		if (symbol.kind == AsmSymbol::Kind::constant) {
+			return static_cast<uint64_t>(symbol.value);
+		}
+		switch (symbol.section) {
+		case AsmSection::text:
+			return text_base + static_cast<uint64_t>(symbol.value);
+		case AsmSection::data:
+			return data_base + static_cast<uint64_t>(symbol.value);
+		case AsmSection::bss:
+			return data_base + data.size() + static_cast<uint64_t>(symbol.value);
+		}
+		return 0;
+	}
+
+	// Patches every fixup for code loaded at text_base and data (followed by
+	// bss) loaded at data_base. Both must be below 4 GB.
+	void link(const uint64_t text_base, const uint64_t data_base) {
+		for (const AsmFixup& fixup : fixups) {
+			const auto it = symbols.find(fixup.symbol);
+			if (it == symbols.end()) {
+				std::cerr << "Undefined symbol: " << fixup.symbol << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			const uint64_t target = address_of(it->second, text_base, data_base) + static_cast<uint64_t>(fixup.addend);
+			std::vector<uint8_t>& bytes = fixup.section == AsmSection::text ? text : data;
+			const uint64_t base = fixup.section == AsmSection::text ? text_base : data_base;
+			switch (fixup.kind) {
+			case AsmFixup::Kind::abs32:
+				if (target > UINT32_MAX) {
+					std::cerr << "Address of " << fixup.symbol << " does not fit in 32 bits" << std::endl;
+					exit(EXIT_FAILURE);
+				}
+				patch(bytes, fixup.offset, target, 4);
+				break;
+			case AsmFixup::Kind::abs64:
+				patch(bytes, fixup.offset, target, 8);
+				break;
+			case AsmFixup::Kind::rel32: {
+				const int64_t rel = static_cast<int64_t>(target) - static_cast<int64_t>(base + fixup.offset + 4);
+				patch(bytes, fixup.offset, static_cast<uint64_t>(rel), 4);
+				break;
+			}
+			}
+		}
+	}
+
+	[[nodiscard]] uint64_t entry(const uint64_t text_base) const {
+		const auto it = symbols.find("_start");
+		if (it == symbols.end() || it->second.section != AsmSection::text) {
+			std::cerr << "Missing _start" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		return text_base + static_cast<uint64_t>(it->second.value);
+	}
+
+private:
+	static void patch(std::vector<uint8_t>& bytes, const size_t offset, const uint64_t value, const size_t width) {
+		for (size_t i = 0; i < width; i++) {
+			bytes[offset + i] = static_cast<uint8_t>(value >> (8 * i));
+		}
+	}
+};
+
+class Assembler {
+public:
+	[[nodiscard]] static ObjectCode assemble(const std::string_view source) {
+		Assembler assembler;
+		assembler.parse(source);
+		assembler.layout_data();
+		assembler.encode_text();
+		return std::move(assembler.m_obj);
+	}
+
+private:
+	struct Operand {
+		enum class Kind : uint8_t {
+			reg,
+			imm,
+			mem
+		} kind = Kind::imm;
+		uint8_t size = 0; // in bytes, 0 when not implied
+		// reg: register number; mem: base register or -1
+		int reg = -1;
+		int index = -1;
+		uint8_t scale = 1;
+		int64_t value = 0; // immediate or displacement
+		std::string symbol {}; // symbolic immediate or displacement
+		bool rex8 = false; // spl/bpl/sil/dil need a REX prefix
+	};
+
+	struct Line {
+		size_t line_no;
+		AsmSection section;
+		std::string label; // fully qualified, empty when none
+		std::string scope; // non-local label that `.local` references attach to
+		std::string mnemonic;
+		std::vector<std::string> args;
+	};
+
+	struct Register {
+		int num;
+		uint8_t size;
+		bool rex8;
+	};
+
+	// Parsing.
+
+	void parse(const std::string_view source) {
+		AsmSection section = AsmSection::text;
+		size_t line_no = 0;
+		size_t pos = 0;
+		while (pos <= source.size()) {
+			size_t end = source.find('\n', pos);
+			if (end == std::string_view::npos) {
+				end = source.size();
+			}
+			line_no++;
+			std::string_view text = strip_comment(source.substr(pos, end - pos));
+			pos = end + 1;
+			text = trim(text);
+			if (text.empty()) {
+				continue;
+			}
+
+			Line line { line_no, section, {}, {}, {}, {} };
+			const size_t word_end = text.find_first_of(" \t");
+			std::string_view first = text.substr(0, word_end);
+			std::string_view rest = word_end == std::string_view::npos ? std::string_view {} : trim(text.substr(word_end));
+
+			if (first == "global" || first == "extern" || first == "default" || first == "bits") {
+				continue;
+			}
+			if (first == "section" || first == "segment") {
+				if (rest == ".text") {
+					section = AsmSection::text;
+				} else if (rest == ".data" || rest == ".rodata") {
+					section = AsmSection::data;
+				} else if (rest == ".bss") {
+					section = AsmSection::bss;
+				} else {
+					error(line_no, "unsupported section " + std::string(rest));
+				}
+				continue;
+			}
+			if (first.back() == ':') {
+				line.label = qualify(first.substr(0, first.size() - 1), true);
+				const size_t after = text.find(':') + 1;
+				text = trim(text.substr(after));
+				if (text.empty()) {
+					line.scope = m_scope;
+					m_lines.push_back(std::move(line));
+					continue;
+				}
+				const size_t instr_end = text.find_first_of(" \t");
+				first = text.substr(0, instr_end);
+				rest = instr_end == std::string_view::npos ? std::string_view {} : trim(text.substr(instr_end));
+			} else if (is_data_directive(next_word(rest))) {
+				// `name db ...` style definitions
+				line.label = qualify(first, true);
+				const std::string_view directive = next_word(rest);
+				first = directive;
+				rest = trim(rest.substr(directive.size()));
+			}
+			line.scope = m_scope;
+			line.mnemonic = lower(first);
+			line.args = split_args(rest, line_no);
+			m_lines.push_back(std::move(line));
+		}
+	}
+
+	// NASM local labels (`.name`) belong to the last non-local label.
+	std::string qualify(const std::string_view name, const bool defining) {
+		if (name.size() > 1 && name[0] == '.' && name[1] != '.') {
+			return m_scope + std::string(name);
+		}
+		if (defining) {
+			m_scope = std::string(name);
+		}
+		return std::string(name);
+	}
+
+	static bool is_data_directive(const std::string_view word) {
+		static constexpr std::array<std::string_view, 9> directives { "db", "dw", "dd", "dq", "resb", "resw", "resd", "resq", "equ" };
+		for (const std::string_view directive : directives) {
+			if (word == directive) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static std::string_view next_word(const std::string_view text) {
+		return text.substr(0, text.find_first_of(" \t"));
+	}
+
+	static std::string_view strip_comment(const std::string_view text) {
+		char quote = 0;
+		for (size_t i = 0; i < text.size(); i++) {
+			const char c = text[i];
+			if (quote != 0) {
+				if (c == quote) {
+					quote = 0;
+				}
+			} else if (c == '"' || c == '\'' || c == '`') {
+				quote = c;
+			} else if (c == ';') {
+				return text.substr(0, i);
+			}
+		}
+		return text;
+	}
+
+	static std::string_view trim(std::string_view text) {
+		while (!text.empty() && (text.front() == ' ' || text.front() == '\t' || text.front() == '\r')) {
+			text.remove_prefix(1);
+		}
+		while (!text.empty() && (text.back() == ' ' || text.back() == '\t' || text.back() == '\r')) {
+			text.remove_suffix(1);
+		}
+		return text;
+	}
+
+	static std::string lower(const std::string_view text) {
+		std::string result(text);
+		for (char& c : result) {
+			if (c >= 'A' && c <= 'Z') {
+				c = static_cast<char>(c - 'A' + 'a');
+			}
+		}
+		return result;
+	}
+
+	static std::vector<std::string> split_args(const std::string_view text, const size_t line_no) {
+		std::vector<std::string> args;
+		if (text.empty()) {
+			return args;
+		}
+		char quote = 0;
+		int depth = 0;
+		size_t start = 0;
+		for (size_t i = 0; i < text.size(); i++) {
+			const char c = text[i];
+			if (quote != 0) {
+				if (c == quote) {
+					quote = 0;
+				}
+			} else if (c == '"' || c == '\'' || c == '`') {
+				quote = c;
+			} else if (c == '[') {
+				depth++;
+			} else if (c == ']') {
+				depth--;
+			} else if (c == ',' && depth == 0) {
+				args.emplace_back(trim(text.substr(start, i - start)));
+				start = i + 1;
+			}
+		}
+		if (quote != 0 || depth != 0) {
+			error(line_no, "unbalanced quotes or brackets");
+		}
+		args.emplace_back(trim(text.substr(start)));
+		return args;
+	}
+
+	[[noreturn]] static void error(const size_t line_no, const std::string& message) {
+		std::cerr << "Assembler error on line " << line_no << ": " << message << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// Data layout. Runs before text encoding so `equ` constants are known
+	// when choosing immediate encodings.
+
+	void layout_data() {
+		for (const Line& line : m_lines) {
+			m_line_no = line.line_no;
+			m_scope = line.scope;
+			if (line.mnemonic == "equ") {
+				if (line.args.size() != 1) {
+					error(line.line_no, "equ takes one expression");
+				}
+				const int64_t here = section_size(line.section);
+				define(line.label, AsmSymbol { AsmSymbol::Kind::constant, line.section, eval_const(line.args[0], line.section, here) });
+				continue;
+			}
+			if (line.section == AsmSection::text) {
+				continue;
+			}
+			if (!line.label.empty()) {
+				define(line.label, AsmSymbol { AsmSymbol::Kind::label, line.section, section_size(line.section) });
+			}
+			if (line.mnemonic.empty()) {
+				continue;
+			}
+			emit_data(line);
+		}
+	}
+
+	void emit_data(const Line& line) {
+		const std::string& directive = line.mnemonic;
+		if (directive.starts_with("res")) {
+			if (line.args.size() != 1) {
+				error(line.line_no, directive + " takes a count");
+			}
+			const size_t count = static_cast<size_t>(eval_const(line.args[0], line.section, section_size(line.section)));
+			const size_t width = data_width(directive[3]);
+			if (line.section == AsmSection::bss) {
+				m_obj.bss_size += count * width;
+			} else {
+				m_obj.data.resize(m_obj.data.size() + count * width, 0);
+			}
+			return;
+		}
+		if (line.section == AsmSection::bss) {
+			error(line.line_no, "initialized data in .bss");
+		}
+		if (directive.size() != 2 || directive[0] != 'd') {
+			error(line.line_no, "unknown directive " + directive);
+		}
+		const size_t width = data_width(directive[1]);
+		for (const std::string& arg : line.args) {
+			if (arg.size() >= 2 && (arg.front() == '"' || arg.front() == '`' || (arg.front() == '\'' && arg.size() != 3))) {
+				for (size_t i = 1; i + 1 < arg.size(); i++) {
+					m_obj.data.push_back(static_cast<uint8_t>(arg[i]));
+				}
+				const size_t padding = (width - (arg.size() - 2) % width) % width;
+				m_obj.data.resize(m_obj.data.size() + padding, 0);
+				continue;
+			}
+			const Operand value = parse_imm(arg);
+			if (!value.symbol.empty()) {
+				if (width != 8 && width != 4) {
+					error(line.line_no, "symbol address needs dd or dq");
+				}
+				m_obj.fixups.push_back(AsmFixup { width == 8 ? AsmFixup::Kind::abs64 : AsmFixup::Kind::abs32, AsmSection::data, m_obj.data.size(), value.symbol, value.value });
+				m_obj.data.resize(m_obj.data.size() + width, 0);
+				continue;
+			}
+			for (size_t i = 0; i < width; i++) {
+				m_obj.data.push_back(static_cast<uint8_t>(static_cast<uint64_t>(value.value) >> (8 * i)));
+			}
+		}
+	}
+
+	static size_t data_width(const char suffix) {
+		switch (suffix) {
+		case 'b':
+			return 1;
+		case 'w':
+			return 2;
+		case 'd':
+			return 4;
+		default:
+			return 8;
+		}
+	}
+
+	[[nodiscard]] int64_t section_size(const AsmSection section) const {
+		switch (section) {
+		case AsmSection::text:
+			return static_cast<int64_t>(m_obj.text.size());
+		case AsmSection::data:
+			return static_cast<int64_t>(m_obj.data.size());
+		case AsmSection::bss:
+			return static_cast<int64_t>(m_obj.bss_size);
+		}
+		return 0;
+	}
+
+	void define(const std::string& name, const AsmSymbol symbol) {
+		if (!m_obj.symbols.emplace(name, symbol).second) {
+			error(m_line_no, "symbol redefined: " + name);
+		}
+	}
+
+	// Evaluates `a + b - c` where every term is a number, a character, `$`,
+	// or a symbol already defined in the same section (label differences)
+	// or as a constant.
+	int64_t eval_const(const std::string_view expr, const AsmSection section, const int64_t here) {
+		int64_t result = 0;
+		int sign = 1;
+		size_t pos = 0;
+		while (pos < expr.size()) {
+			const size_t end = expr.find_first_of("+-", pos == 0 ? 0 : pos);
+			std::string_view term = trim(expr.substr(pos, end == std::string_view::npos ? std::string_view::npos : end - pos));
+			if (!term.empty()) {
+				int64_t value = 0;
+				if (term == "$") {
+					value = here;
+				} else if (const std::optional<int64_t> number = parse_number(term)) {
+					value = number.value();
+				} else {
+					const auto it = m_obj.symbols.find(qualify(term, false));
+					if (it == m_obj.symbols.end() || (it->second.kind == AsmSymbol::Kind::label && it->second.section != section)) {
+						error(m_line_no, "cannot evaluate " + std::string(expr));
+					}
+					value = it->second.value;
+				}
+				result += sign * value;
+			}
+			if (end == std::string_view::npos) {
+				break;
+			}
+			sign = expr[end] == '-' ? -1 : 1;
+			pos = end + 1;
+		}
+		return result;
+	}
+
+	static std::optional<int64_t> parse_number(std::string_view text) {
+		if (text.size() == 3 && text.front() == '\'' && text.back() == '\'') {
+			return static_cast<unsigned char>(text[1]);
+		}
+		bool negative = false;
+		if (!text.empty() && text.front() == '-') {
+			negative = true;
+			text.remove_prefix(1);
+		}
+		if (text.empty() || text.front() < '0' || text.front() > '9') {
+			return {};
+		}
+		int base = 10;
+		if (text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) {
+			base = 16;
+			text.remove_prefix(2);
+		} else if (text.back() == 'h' || text.back() == 'H') {
+			base = 16;
+			text.remove_suffix(1);
+		}
+		uint64_t value = 0;
+		for (const char c : text) {
+			int digit;
+			if (c >= '0' && c <= '9') {
+				digit = c - '0';
+			} else if (base == 16 && c >= 'a' && c <= 'f') {
+				digit = c - 'a' + 10;
+			} else if (base == 16 && c >= 'A' && c <= 'F') {
+				digit = c - 'A' + 10;
+			} else if (c == '_') {
+				continue;
+			} else {
+				return {};
+			}
+			value = value * static_cast<uint64_t>(base) + static_cast<uint64_t>(digit);
+		}
+		return negative ? -static_cast<int64_t>(value) : static_cast<int64_t>(value);
+	}
+
+	// Operands.
+
+	static std::optional<Register> parse_register(const std::string_view name) {
+		static const std::unordered_map<std::string_view, Register> registers = [] {
+			std::unordered_map<std::string_view, Register> map;
+			static constexpr std::array<std::string_view, 16> r64 { "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15" };
+			static constexpr std::array<std::string_view, 16> r32 { "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d" };
+			static constexpr std::array<std::string_view, 16> r16 { "ax", "cx", "dx", "bx", "sp", "bp", "si", "di", "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w" };
+			static constexpr std::array<std::string_view, 16> r8 { "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil", "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b" };
+			for (int i = 0; i < 16; i++) {
+				map.emplace(r64[i], Register { i, 8, false });
+				map.emplace(r32[i], Register { i, 4, false });
+				map.emplace(r16[i], Register { i, 2, false });
+				map.emplace(r8[i], Register { i, 1, i >= 4 && i < 8 });
+			}
+			return map;
+		}();
+		const auto it = registers.find(lower(name));
+		if (it == registers.end()) {
+			return {};
+		}
+		return it->second;
+	}
+
+	Operand parse_operand(std::string_view text) {
+		Operand operand;
+		static constexpr std::array<std::pair<std::string_view, uint8_t>, 4> size_keywords { { { "byte", 1 }, { "word", 2 }, { "dword", 4 }, { "qword", 8 } } };
+		const std::string first = lower(next_word(text));
+		for (const auto& [keyword, size] : size_keywords) {
+			if (first == keyword) {
+				operand.size = size;
+				text = trim(text.substr(keyword.size()));
+				break;
+			}
+		}
+		if (!text.empty() && text.front() == '[') {
+			if (text.back() != ']') {
+				error(m_line_no, "malformed memory operand");
+			}
+			parse_memory(trim(text.substr(1, text.size() - 2)), operand);
+			return operand;
+		}
+		if (const std::optional<Register> reg = parse_register(text)) {
+			operand.kind = Operand::Kind::reg;
+			operand.reg = reg->num;
+			operand.size = reg->size;
+			operand.rex8 = reg->rex8;
+			return operand;
+		}
+		Operand imm = parse_imm(text);
+		imm.size = operand.size;
+		return imm;
+	}
+
+	// A constant, a character, a symbol, or `symbol +/- constant`.
+	Operand parse_imm(const std::string_view text) {
+		Operand operand;
+		operand.kind = Operand::Kind::imm;
+		if (const std::optional<int64_t> number = parse_number(text)) {
+			operand.value = number.value();
+			return operand;
+		}
+		size_t split = text.find_first_of("+-", 1);
+		std::string_view name = trim(text.substr(0, split));
+		if (split != std::string_view::npos) {
+			const std::optional<int64_t> addend = parse_number(trim(text.substr(split + 1)));
+			if (!addend.has_value()) {
+				error(m_line_no, "unsupported expression " + std::string(text));
+			}
+			operand.value = text[split] == '-' ? -addend.value() : addend.value();
+		}
+		std::string symbol = qualify(name, false);
+		const auto it = m_obj.symbols.find(symbol);
+		if (it != m_obj.symbols.end() && it->second.kind == AsmSymbol::Kind::constant) {
+			operand.value += it->second.value;
+		} else {
+			operand.symbol = std::move(symbol);
+		}
+		return operand;
+	}
+
+	void parse_memory(const std::string_view text, Operand& operand) {
+		operand.kind = Operand::Kind::mem;
+		int sign = 1;
+		size_t pos = 0;
+		while (pos <= text.size()) {
+			const size_t end = text.find_first_of("+-", pos);
+			const std::string_view term = trim(text.substr(pos, end == std::string_view::npos ? std::string_view::npos : end - pos));
+			if (!term.empty()) {
+				const size_t star = term.find('*');
+				if (star != std::string_view::npos) {
+					const std::optional<Register> reg = parse_register(trim(term.substr(0, star)));
+					const std::optional<int64_t> scale = parse_number(trim(term.substr(star + 1)));
+					if (!reg.has_value() || !scale.has_value() || operand.index != -1 || sign < 0) {
+						error(m_line_no, "bad index term " + std::string(term));
+					}
+					operand.index = reg->num;
+					operand.scale = static_cast<uint8_t>(scale.value());
+				} else if (const std::optional<Register> reg = parse_register(term)) {
+					if (sign < 0) {
+						error(m_line_no, "cannot subtract a register");
+					}
+					if (operand.reg == -1) {
+						operand.reg = reg->num;
+					} else if (operand.index == -1) {
+						operand.index = reg->num;
+					} else {
+						error(m_line_no, "too many registers in memory operand");
+					}
+				} else {
+					const Operand imm = parse_imm(term);
+					if (!imm.symbol.empty()) {
+						if (!operand.symbol.empty() || sign < 0) {
+							error(m_line_no, "unsupported memory operand");
+						}
+						operand.symbol = imm.symbol;
+					}
+					operand.value += sign * imm.value;
+				}
+			}
+			if (end == std::string_view::npos) {
+				break;
+			}
+			sign = text[end] == '-' ? -1 : 1;
+			pos = end + 1;
+		}
+		if (operand.index == 4) {
+			error(m_line_no, "rsp cannot be an index register");
+		}
+	}
+
+	// Encoding.
+
+	void encode_text() {
+		for (const Line& line : m_lines) {
+			if (line.section != AsmSection::text) {
+				continue;
+			}
+			m_line_no = line.line_no;
+			if (!line.label.empty() && line.mnemonic != "equ") {
+				define(line.label, AsmSymbol { AsmSymbol::Kind::label, AsmSection::text, section_size(AsmSection::text) });
+			}
+			if (line.mnemonic.empty() || line.mnemonic == "equ") {
+				continue;
+			}
+			m_scope = line.scope;
+			std::vector<Operand> operands;
+			for (const std::string& arg : line.args) {
+				operands.push_back(parse_operand(arg));
+			}
+			encode(line.mnemonic, operands);
+		}
+	}
+
+	void emit8(const uint8_t byte) {
+		m_obj.text.push_back(byte);
+	}
+
+	void emit_le(const uint64_t value, const size_t width) {
+		for (size_t i = 0; i < width; i++) {
+			emit8(static_cast<uint8_t>(value >> (8 * i)));
+		}
+	}
+
+	void emit_imm(const Operand& imm, const size_t width) {
+		if (!imm.symbol.empty()) {
+			if (width < 4) {
+				error(m_line_no, "symbol in a narrow immediate");
+			}
+			m_obj.fixups.push_back(AsmFixup { width == 8 ? AsmFixup::Kind::abs64 : AsmFixup::Kind::abs32, AsmSection::text, m_obj.text.size(), imm.symbol, imm.value });
+			emit_le(0, width);
+			return;
+		}
+		emit_le(static_cast<uint64_t>(imm.value), width);
+	}
+
+	static bool fits8(const int64_t value) {
+		return value >= -128 && value <= 127;
+	}
+
+	static bool fits32(const int64_t value) {
+		return value >= INT32_MIN && value <= INT32_MAX;
+	}
+
+	// Emits [prefixes] REX opcode ModRM [SIB] [disp] for an r/m operand with
+	// `reg_field` in ModRM.reg (a register number or an opcode extension).
+	void emit_modrm(const std::vector<uint8_t>& opcode, const int reg_field, const Operand& rm, const uint8_t size, const bool reg_rex8 = false) {
+		if (size == 2) {
+			emit8(0x66);
+		}
+		uint8_t rex = 0;
+		if (size == 8) {
+			rex |= 0x08;
+		}
+		if (reg_field & 8) {
+			rex |= 0x04;
+		}
+		if (rm.kind == Operand::Kind::mem) {
+			if (rm.index != -1 && (rm.index & 8)) {
+				rex |= 0x02;
+			}
+			if (rm.reg != -1 && (rm.reg & 8)) {
+				rex |= 0x01;
+			}
+		} else if (rm.reg & 8) {
+			rex |= 0x01;
+		}
+		if (rex != 0 || reg_rex8 || (rm.kind == Operand::Kind::reg && rm.rex8)) {
+			emit8(0x40 | rex);
+		}
+		for (const uint8_t byte : opcode) {
+			emit8(byte);
+		}
+
+		const int reg_bits = (reg_field & 7) << 3;
+		if (rm.kind == Operand::Kind::reg) {
+			emit8(static_cast<uint8_t>(0xC0 | reg_bits | (rm.reg & 7)));
+			return;
+		}
+
+		const bool has_symbol = !rm.symbol.empty();
+		if (rm.reg == -1) {
+			// [disp32] or [index*scale + disp32] through a SIB with no base
+			emit8(static_cast<uint8_t>(0x04 | reg_bits));
+			const int index = rm.index == -1 ? 4 : (rm.index & 7);
+			emit8(static_cast<uint8_t>((scale_bits(rm.scale) << 6) | (index << 3) | 5));
+			emit_disp32(rm);
+			return;
+		}
+
+		const int base = rm.reg & 7;
+		int mod;
+		if (!has_symbol && rm.value == 0 && base != 5) {
+			mod = 0;
+		} else if (!has_symbol && fits8(rm.value)) {
+			mod = 1;
+		} else {
+			mod = 2;
+		}
+		if (rm.index != -1 || base == 4) {
+			emit8(static_cast<uint8_t>((mod << 6) | reg_bits | 4));
+			const int index = rm.index == -1 ? 4 : (rm.index & 7);
+			emit8(static_cast<uint8_t>((scale_bits(rm.scale) << 6) | (index << 3) | base));
+		} else {
+			emit8(static_cast<uint8_t>((mod << 6) | reg_bits | base));
+		}
+		if (mod == 1) {
+			emit8(static_cast<uint8_t>(rm.value));
+		} else if (mod == 2) {
+			emit_disp32(rm);
+		}
+	}
+
+	void emit_disp32(const Operand& mem) {
+		if (!mem.symbol.empty()) {
+			m_obj.fixups.push_back(AsmFixup { AsmFixup::Kind::abs32, AsmSection::text, m_obj.text.size(), mem.symbol, mem.value });
+			emit_le(0, 4);
+		} else {
+			if (!fits32(mem.value)) {
+				error(m_line_no, "displacement out of range");
+			}
+			emit_le(static_cast<uint64_t>(mem.value), 4);
+		}
+	}
+
+	int scale_bits(const uint8_t scale) const {
+		switch (scale) {
+		case 1:
+			return 0;
+		case 2:
+			return 1;
+		case 4:
+			return 2;
+		case 8:
+			return 3;
+		default:
+			error(m_line_no, "scale must be 1, 2, 4 or 8");
+		}
+	}
+
+	// Short register form: REX.B + (opcode | reg & 7).
+	void emit_short_reg(const uint8_t opcode, const Operand& reg, const bool rex_w) {
+		uint8_t rex = rex_w ? 0x08 : 0;
+		if (reg.reg & 8) {
+			rex |= 0x01;
+		}
+		if (rex != 0 || reg.rex8) {
+			emit8(0x40 | rex);
+		}
+		emit8(static_cast<uint8_t>(opcode | (reg.reg & 7)));
+	}
+
+	void emit_rel32(const std::vector<uint8_t>& opcode, const Operand& target) {
+		if (target.kind != Operand::Kind::imm || target.symbol.empty()) {
+			error(m_line_no, "branch target must be a label");
+		}
+		for (const uint8_t byte : opcode) {
+			emit8(byte);
+		}
+		m_obj.fixups.push_back(AsmFixup { AsmFixup::Kind::rel32, AsmSection::text, m_obj.text.size(), target.symbol, target.value });
+		emit_le(0, 4);
+	}
+
+	uint8_t operand_size(const std::vector<Operand>& ops) const {
+		uint8_t size = 0;
+		for (const Operand& op : ops) {
+			if (op.kind == Operand::Kind::reg || (op.kind == Operand::Kind::mem && op.size != 0)) {
+				if (size != 0 && op.size != size) {
+					error(m_line_no, "operand size mismatch");
+				}
+				size = op.size;
+			}
+		}
+		if (size == 0) {
+			error(m_line_no, "operation size not specified");
+		}
+		return size;
+	}
+
+	void expect(const bool condition, const std::string& mnemonic) const {
+		if (!condition) {
+			error(m_line_no, "unsupported operands for " + mnemonic);
+		}
+	}
+
+	static std::optional<uint8_t> condition_code(const std::string_view cc) {
+		static const std::unordered_map<std::string_view, uint8_t> codes {
+			{ "o", 0x0 }, { "no", 0x1 }, { "b", 0x2 }, { "c", 0x2 }, { "nae", 0x2 },
+			{ "ae", 0x3 }, { "nb", 0x3 }, { "nc", 0x3 }, { "e", 0x4 }, { "z", 0x4 },
+			{ "ne", 0x5 }, { "nz", 0x5 }, { "be", 0x6 }, { "na", 0x6 }, { "a", 0x7 },
+			{ "nbe", 0x7 }, { "s", 0x8 }, { "ns", 0x9 }, { "p", 0xA }, { "pe", 0xA },
+			{ "np", 0xB }, { "po", 0xB }, { "l", 0xC }, { "nge", 0xC }, { "ge", 0xD },
+			{ "nl", 0xD }, { "le", 0xE }, { "ng", 0xE }, { "g", 0xF }, { "nle", 0xF },
+		};
+		const auto it = codes.find(cc);
+		if (it == codes.end()) {
+			return {};
+		}
+		return it->second;
+	}
+
+	void encode(const std::string& m, const std::vector<Operand>& ops) {
+		using Kind = Operand::Kind;
+		const auto is = [&](const size_t i, const Kind kind) {
+			return i < ops.size() && ops[i].kind == kind;
+		};
+
+		static const std::unordered_map<std::string_view, int> alu { { "add", 0 }, { "or", 1 }, { "adc", 2 }, { "sbb", 3 }, { "and", 4 }, { "sub", 5 }, { "xor", 6 }, { "cmp", 7 } };
+		static const std::unordered_map<std::string_view, int> unary { { "not", 2 }, { "neg", 3 }, { "mul", 4 }, { "div", 6 }, { "idiv", 7 } };
+		static const std::unordered_map<std::string_view, int> shifts { { "rol", 0 }, { "ror", 1 }, { "shl", 4 }, { "sal", 4 }, { "shr", 5 }, { "sar", 7 } };
+
+		if (m == "ret" && ops.empty()) {
+			emit8(0xC3);
+		} else if (m == "syscall") {
+			emit8(0x0F);
+			emit8(0x05);
+		} else if (m == "nop") {
+			emit8(0x90);
+		} else if (m == "cqo") {
+			emit8(0x48);
+			emit8(0x99);
+		} else if (m == "leave") {
+			emit8(0xC9);
+		} else if (m == "mov") {
+			expect(ops.size() == 2, m);
+			if (is(0, Kind::reg) && is(1, Kind::imm)) {
+				const Operand& dst = ops[0];
+				const Operand& imm = ops[1];
+				if (dst.size == 8) {
+					if (!imm.symbol.empty() || (imm.value >= 0 && imm.value <= UINT32_MAX)) {
+						// 32-bit mov zero-extends into the full register.
+						emit_short_reg(0xB8, dst, false);
+						emit_imm(imm, 4);
+					} else if (fits32(imm.value)) {
+						emit_modrm({ 0xC7 }, 0, dst, 8);
+						emit_imm(imm, 4);
+					} else {
+						emit_short_reg(0xB8, dst, true);
+						emit_imm(imm, 8);
+					}
+				} else if (dst.size == 1) {
+					emit_short_reg(0xB0, dst, false);
+					emit_imm(imm, 1);
+				} else {
+					if (dst.size == 2) {
+						emit8(0x66);
+					}
+					emit_short_reg(0xB8, dst, false);
+					emit_imm(imm, dst.size);
+				}
+			} else if (is(0, Kind::mem) && is(1, Kind::imm)) {
+				const uint8_t size = ops[0].size;
+				expect(size != 0, m);
+				emit_modrm({ static_cast<uint8_t>(size == 1 ? 0xC6 : 0xC7) }, 0, ops[0], size);
+				emit_imm(ops[1], size == 8 ? 4 : size);
+			} else if (is(1, Kind::reg) && !is(0, Kind::imm)) {
+				const uint8_t size = operand_size(ops);
+				emit_modrm({ static_cast<uint8_t>(size == 1 ? 0x88 : 0x89) }, ops[1].reg, ops[0], size, ops[1].rex8);
+			} else if (is(0, Kind::reg) && is(1, Kind::mem)) {
+				const uint8_t size = operand_size(ops);
+				emit_modrm({ static_cast<uint8_t>(size == 1 ? 0x8A : 0x8B) }, ops[0].reg, ops[1], size, ops[0].rex8);
+			} else {
+				expect(false, m);
+			}
+		} else if (alu.contains(m)) {
+			expect(ops.size() == 2, m);
+			const int n = alu.at(m);
+			if (is(1, Kind::imm)) {
+				expect(is(0, Kind::reg) || is(0, Kind::mem), m);
+				const uint8_t size = ops[0].size;
+				expect(size != 0, m);
+				if (size == 1) {
+					emit_modrm({ 0x80 }, n, ops[0], size);
+					emit_imm(ops[1], 1);
+				} else if (ops[1].symbol.empty() && fits8(ops[1].value)) {
+					emit_modrm({ 0x83 }, n, ops[0], size);
+					emit_imm(ops[1], 1);
+				} else {
+					emit_modrm({ 0x81 }, n, ops[0], size);
+					emit_imm(ops[1], size == 2 ? 2 : 4);
+				}
+			} else if (is(1, Kind::reg)) {
+				const uint8_t size = operand_size(ops);
+				emit_modrm({ static_cast<uint8_t>(n * 8 + (size == 1 ? 0 : 1)) }, ops[1].reg, ops[0], size, ops[1].rex8);
+			} else if (is(0, Kind::reg) && is(1, Kind::mem)) {
+				const uint8_t size = operand_size(ops);
+				emit_modrm({ static_cast<uint8_t>(n * 8 + (size == 1 ? 2 : 3)) }, ops[0].reg, ops[1], size, ops[0].rex8);
+			} else {
+				expect(false, m);
+			}
+		} else if (m == "test") {
+			expect(ops.size() == 2 && !is(0, Kind::imm), m);
+			if (is(1, Kind::reg)) {
+				const uint8_t size = operand_size(ops);
+				emit_modrm({ static_cast<uint8_t>(size == 1 ? 0x84 : 0x85) }, ops[1].reg, ops[0], size, ops[1].rex8);
+			} else {
+				expect(is(1, Kind::imm) && ops[0].size != 0, m);
+				const uint8_t size = ops[0].size;
+				emit_modrm({ static_cast<uint8_t>(size == 1 ? 0xF6 : 0xF7) }, 0, ops[0], size);
+				emit_imm(ops[1], size == 1 ? 1 : (size == 2 ? 2 : 4));
+			}
+		} else if (unary.contains(m) || (m == "imul" && ops.size() == 1)) {
+			expect(ops.size() == 1 && !is(0, Kind::imm), m);
+			const int n = m == "imul" ? 5 : unary.at(m);
+			const uint8_t size = operand_size(ops);
+			emit_modrm({ static_cast<uint8_t>(size == 1 ? 0xF6 : 0xF7) }, n, ops[0], size);
+		} else if (m == "imul") {
+			expect(is(0, Kind::reg) && (is(1, Kind::reg) || is(1, Kind::mem)), m);
+			const uint8_t size = operand_size({ ops[0], ops[1] });
+			if (ops.size() == 2) {
+				emit_modrm({ 0x0F, 0xAF }, ops[0].reg, ops[1], size);
+			} else {
+				expect(ops.size() == 3 && is(2, Kind::imm), m);
+				if (ops[2].symbol.empty() && fits8(ops[2].value)) {
+					emit_modrm({ 0x6B }, ops[0].reg, ops[1], size);
+					emit_imm(ops[2], 1);
+				} else {
+					emit_modrm({ 0x69 }, ops[0].reg, ops[1], size);
+					emit_imm(ops[2], 4);
+				}
+			}
+		} else if (m == "inc" || m == "dec") {
+			expect(ops.size() == 1 && !is(0, Kind::imm), m);
+			const uint8_t size = operand_size(ops);
+			emit_modrm({ static_cast<uint8_t>(size == 1 ? 0xFE : 0xFF) }, m == "inc" ? 0 : 1, ops[0], size);
+		} else if (shifts.contains(m)) {
+			expect(ops.size() == 2 && !is(0, Kind::imm), m);
+			const int n = shifts.at(m);
+			const uint8_t size = ops[0].size;
+			expect(size != 0, m);
+			const bool byte = size == 1;
+			if (is(1, Kind::reg)) {
+				expect(ops[1].reg == 1 && ops[1].size == 1, m); // cl
+				emit_modrm({ static_cast<uint8_t>(byte ? 0xD2 : 0xD3) }, n, ops[0], size);
+			} else if (ops[1].value == 1) {
+				emit_modrm({ static_cast<uint8_t>(byte ? 0xD0 : 0xD1) }, n, ops[0], size);
+			} else {
+				emit_modrm({ static_cast<uint8_t>(byte ? 0xC0 : 0xC1) }, n, ops[0], size);
+				emit_imm(ops[1], 1);
+			}
+		} else if (m == "lea") {
+			expect(ops.size() == 2 && is(0, Kind::reg) && is(1, Kind::mem), m);
+			emit_modrm({ 0x8D }, ops[0].reg, ops[1], ops[0].size);
+		} else if (m == "movzx" || m == "movsx") {
+			expect(ops.size() == 2 && is(0, Kind::reg) && !is(1, Kind::imm), m);
+			const uint8_t src_size = ops[1].size == 0 ? 1 : ops[1].size;
+			expect(src_size == 1 || src_size == 2, m);
+			const uint8_t opcode = static_cast<uint8_t>((m == "movzx" ? 0xB6 : 0xBE) + (src_size == 2 ? 1 : 0));
+			emit_modrm({ 0x0F, opcode }, ops[0].reg, ops[1], ops[0].size, ops[1].rex8);
+		} else if (m == "xchg") {
+			expect(ops.size() == 2 && is(1, Kind::reg) && !is(0, Kind::imm), m);
+			const uint8_t size = operand_size(ops);
+			emit_modrm({ static_cast<uint8_t>(size == 1 ? 0x86 : 0x87) }, ops[1].reg, ops[0], size, ops[1].rex8);
+		} else if (m == "push") {
+			expect(ops.size() == 1, m);
+			if (is(0, Kind::reg)) {
+				expect(ops[0].size == 8, m);
+				emit_short_reg(0x50, ops[0], false);
+			} else if (is(0, Kind::mem)) {
+				emit_modrm({ 0xFF }, 6, ops[0], 0);
+			} else if (ops[0].symbol.empty() && fits8(ops[0].value)) {
+				emit8(0x6A);
+				emit_imm(ops[0], 1);
+			} else {
+				emit8(0x68);
+				emit_imm(ops[0], 4);
+			}
+		} else if (m == "pop") {
+			expect(ops.size() == 1 && !is(0, Kind::imm), m);
+			if (is(0, Kind::reg)) {
+				expect(ops[0].size == 8, m);
+				emit_short_reg(0x58, ops[0], false);
+			} else {
+				emit_modrm({ 0x8F }, 0, ops[0], 0);
+			}
+		} else if (m == "jmp" || m == "call") {
+			expect(ops.size() == 1, m);
+			if (is(0, Kind::imm)) {
+				emit_rel32({ static_cast<uint8_t>(m == "jmp" ? 0xE9 : 0xE8) }, ops[0]);
+			} else {
+				emit_modrm({ 0xFF }, m == "jmp" ? 4 : 2, ops[0], 0);
+			}
+		} else if (m.size() > 1 && m[0] == 'j' && condition_code(std::string_view(m).substr(1))) {
+			expect(ops.size() == 1, m);
+			emit_rel32({ 0x0F, static_cast<uint8_t>(0x80 | condition_code(std::string_view(m).substr(1)).value()) }, ops[0]);
+		} else if (m.size() > 3 && m.starts_with("set") && condition_code(std::string_view(m).substr(3))) {
+			expect(ops.size() == 1 && !is(0, Kind::imm), m);
+			emit_modrm({ 0x0F, static_cast<uint8_t>(0x90 | condition_code(std::string_view(m).substr(3)).value()) }, 0, ops[0], 0, ops[0].rex8);
+		} else if (m.size() > 4 && m.starts_with("cmov") && condition_code(std::string_view(m).substr(4))) {
+			expect(ops.size() == 2 && is(0, Kind::reg) && !is(1, Kind::imm), m);
+			emit_modrm({ 0x0F, static_cast<uint8_t>(0x40 | condition_code(std::string_view(m).substr(4)).value()) }, ops[0].reg, ops[1], operand_size(ops));
+		} else {
+			error(m_line_no, "unsupported instruction " + m);
+		}
+	}
+
+	ObjectCode m_obj {};
+	std::vector<Line> m_lines {};
+	std::string m_scope {};
+	size_t m_line_no = 0;
+};
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <span>
+#include <string_view>
+
+#include "./driver.hpp"
+#include "./generation.hpp"
+#include "./inline.hpp"
+#include "./ir_lower.hpp"
+#include "./ir_passes.hpp"
+#include "./jit.hpp"
+#include "./parser.hpp"
+#include "./scan.hpp"
+#include "./source.hpp"
+#include "./tokenization.hpp"
+
+// Incremented by the replacement operator new in main.cpp. Per thread, so
+// the --jobs and --batch workers never contend on it; --bench-alloc reads
+// the main thread's count around work done on the main thread.
+inline thread_local size_t heap_allocations = 0;
+
+// Walks the source with only the run scanners, without building tokens, so
+// the kernels can be compared without allocation noise.
+inline size_t scan_runs(const std::string_view src, const Scanner& scanner) {
+	const char* const data = src.data();
+	const size_t size = src.size();
+	size_t runs = 0;
+	size_t index = 0;
+	while (index < size) {
+		switch (char_class(data[index])) {
+		case CharClass::space:
+			index = scanner.skip_space(data, index + 1, size);
+			break;
+		case CharClass::alpha:
+			index = scanner.skip_ident(data, index + 1, size);
+			break;
+		case CharClass::digit:
+			index = scanner.skip_digits(data, index + 1, size);
+			break;
+		default:
+			index++;
+			break;
+		}
+		runs++;
+	}
+	return runs;
+}
+
+template <typename F>
+inline void bench_report(const char* kernel, const char* what, const size_t num_bytes, F&& f) {
+	size_t runs = 0;
+	const auto start = std::chrono::steady_clock::now();
+	auto elapsed = std::chrono::steady_clock::duration::zero();
+	do {
+		f();
+		runs++;
+		elapsed = std::chrono::steady_clock::now() - start;
+	} while (elapsed < std::chrono::milliseconds(500));
+
+	const double seconds = std::chrono::duration<double>(elapsed).count();
+	const double mb = static_cast<double>(num_bytes) * static_cast<double>(runs) / (1024.0 * 1024.0);
+	std::cout << std::left << std::setw(8) << kernel << std::setw(10) << what
+			  << std::right << std::fixed << std::setprecision(1) << std::setw(10) << mb / seconds << " MB/s"
+			  << "  (" << runs << " runs)" << std::endl;
+}
+
+// Lexer throughput for every scan kernel this CPU supports, in MB/s of
+// source text, both for the bare run scanners and for a full tokenize.
+// Each measurement repeats for at least half a second so small inputs
+// still give stable numbers.
+inline void bench_lex(const std::string_view src) {
+	const ScanKernel best = detect_scan_kernel();
+	size_t expected_tokens = 0;
+	for (const ScanKernel kernel : { ScanKernel::scalar, ScanKernel::sse2, ScanKernel::avx2 }) {
+		if (static_cast<int>(kernel) > static_cast<int>(best)) {
+			break;
+		}
+		size_t num_tokens = 0;
+		bench_report(scan_kernel_name(kernel), "scan", src.size(), [&] {
+			num_tokens = scan_runs(src, scanner_for(kernel));
+		});
+		bench_report(scan_kernel_name(kernel), "tokenize", src.size(), [&] {
+			Tokenizer tokenizer(src, kernel);
+			num_tokens = tokenizer.tokenize().size();
+		});
+
+		if (kernel == ScanKernel::scalar) {
+			expected_tokens = num_tokens;
+		} else if (num_tokens != expected_tokens) {
+			std::cerr << scan_kernel_name(kernel) << " produced " << num_tokens << " tokens, scalar produced " << expected_tokens << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+inline size_t count_stmts(const NodeStmt* stmt);
+
+inline size_t count_stmts(const std::pmr::vector<NodeStmt*>& stmts) {
+	size_t count = 0;
+	for (const NodeStmt* stmt : stmts) {
+		count += count_stmts(stmt);
+	}
+	return count;
+}
+
+inline size_t count_stmts(const NodeStmt* stmt) {
+	struct StmtVisitor {
+		size_t operator()(const NodeScope* scope) const {
+			return 1 + count_stmts(scope->stmts);
+		}
+		size_t operator()(const NodeStmtIf* stmt_if) const {
+			return 1 + count_stmts(stmt_if->scope->stmts);
+		}
+		size_t operator()(const NodeStmtFor* stmt_for) const {
+			return 1 + count_stmts(stmt_for->scope->stmts);
+		}
+		size_t operator()(const NodeStmtFunction* stmt_function) const {
+			return 1 + count_stmts(stmt_function->scope->stmts);
+		}
+		size_t operator()(const NodeStmtExit*) const {
+			return 1;
+		}
+		size_t operator()(const NodeStmtLet*) const {
+			return 1;
+		}
+		size_t operator()(const NodeStmtPrint*) const {
+			return 1;
+		}
+		size_t operator()(const NodeStmtAssign*) const {
+			return 1;
+		}
+		size_t operator()(const NodeStmtFunctionCall*) const {
+			return 1;
+		}
+		size_t operator()(const NodeStmtReturn*) const {
+			return 1;
+		}
+	};
+	return std::visit(StmtVisitor {}, stmt->var);
+}
+
+// Global heap allocations made while tokenizing and parsing, per thousand
+// statements. With the arena backing every AST container this should only
+// be the arena's own block bookkeeping.
+inline void bench_alloc(const std::string_view src) {
+	Tokenizer tokenizer(src);
+	const size_t before = heap_allocations;
+	Parser parser(tokenizer);
+	const std::optional<NodeProg> prog = parser.parse_prog();
+	const size_t allocations = heap_allocations - before;
+	if (!prog.has_value()) {
+		std::cerr << "Invalid program" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	const size_t num_stmts = count_stmts(prog->stmts);
+	const ArenaAllocator::Stats arena = parser.arena_stats();
+	std::cout << "statements      " << num_stmts << std::endl;
+	std::cout << "heap allocs     " << allocations << std::endl;
+	std::cout << "allocs / 1k     " << std::fixed << std::setprecision(3)
+			  << (num_stmts == 0 ? 0.0 : static_cast<double>(allocations) * 1000.0 / static_cast<double>(num_stmts)) << std::endl;
+	std::cout << "arena used      " << arena.bytes_used << " bytes in " << arena.blocks << " blocks" << std::endl;
+}
+
+struct JitTiming {
+	Jit::Result result;
+	size_t runs;
+	double ms_per_run;
+};
+
+// Runs `obj` through the JIT repeatedly for at least half a second.
+inline JitTiming time_jit(const ObjectCode& obj) {
+	size_t runs = 0;
+	Jit::Result result;
+	const auto start = std::chrono::steady_clock::now();
+	auto elapsed = std::chrono::steady_clock::duration::zero();
+	do {
+		result = Jit::run(obj);
+		runs++;
+		elapsed = std::chrono::steady_clock::now() - start;
+	} while (elapsed < std::chrono::milliseconds(500));
+	return { result, runs, std::chrono::duration<double, std::milli>(elapsed).count() / static_cast<double>(runs) };
+}
+
+// Parses, inlines, folds and assembles `src` with the AST Generator, or with the
+// SSA IR path when `ir` is set. Successive calls share one arena.
+inline ObjectCode compile_for_bench(const std::string_view src, const bool ir, const GenOptions options = {}) {
+	static ArenaAllocator arena(Parser::default_arena_bytes);
+	return Assembler::assemble(compile_to_asm(src, CompileOptions { .gen = options, .ir = ir }, arena).str());
+}
+
+// Runtime of the compiled program with each code generator: the AST
+// Generator with stack and with register expressions, and the SSA IR. The
+// program runs in memory through the JIT, repeated for at least half a
+// second; fork and mapping costs are included, so the input should loop
+// long enough for its own arithmetic to dominate.
+inline void bench_codegen(const std::string_view src) {
+	std::optional<int> expected_exit_code;
+	for (const char* const name : { "stack", "registers", "ir" }) {
+		const ObjectCode obj = compile_for_bench(src, std::string_view(name) == "ir", GenOptions { .stack_exprs = std::string_view(name) == "stack" });
+		const JitTiming timing = time_jit(obj);
+		std::cout << std::left << std::setw(10) << name
+				  << std::right << std::setw(8) << obj.text.size() << " bytes"
+				  << std::fixed << std::setprecision(3) << std::setw(12) << timing.ms_per_run << " ms/run"
+				  << "  (" << timing.runs << " runs)" << std::endl;
+
+		if (!timing.result.exited) {
+			std::cerr << name << " code was killed by signal " << timing.result.signal << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		if (!expected_exit_code.has_value()) {
+			expected_exit_code = timing.result.exit_code;
+		} else if (timing.result.exit_code != expected_exit_code) {
+			std::cerr << name << " code exited with " << timing.result.exit_code << ", stack code with " << *expected_exit_code << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+// Register code for each arithmetic kernel with and without strength
+// reduction of * and / by constants (see bench/kernels). Both builds must
+// exit with the same code.
+inline void bench_arith(const std::span<char* const> paths) {
+	std::cout << std::left << std::setw(28) << "kernel" << std::right << std::setw(12) << "plain ms" << std::setw(12) << "reduced ms"
+			  << std::setw(10) << "speedup" << std::endl;
+	for (const char* const path : paths) {
+		const SourceFile source(path);
+		std::array<JitTiming, 2> timings {};
+		for (size_t reduce = 0; reduce < 2; reduce++) {
+			timings[reduce] = time_jit(compile_for_bench(source.view(), false, GenOptions { .strength_reduce = reduce == 1 }));
+			if (!timings[reduce].result.exited) {
+				std::cerr << path << " was killed by signal " << timings[reduce].result.signal << std::endl;
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (timings[0].result.exit_code != timings[1].result.exit_code) {
+			std::cerr << path << ": reduced code exited with " << timings[1].result.exit_code << ", plain code with "
+					  << timings[0].result.exit_code << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		std::cout << std::left << std::setw(28) << path << std::right << std::fixed << std::setprecision(3)
+				  << std::setw(12) << timings[0].ms_per_run << std::setw(12) << timings[1].ms_per_run
+				  << std::setprecision(2) << std::setw(9) << timings[0].ms_per_run / timings[1].ms_per_run << "x" << std::endl;
+	}
+}
@@ -0,0 +1,259 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "./emitter.hpp"
+
+// Build stamp of this compiler, part of every cache key, so a rebuilt
+// compiler never picks up executables produced by an older one.
+inline constexpr std::string_view compiler_version = "mine " __DATE__ " " __TIME__;
+
+// On-disk cache of compiled programs keyed by content: the key is a 128-bit
+// FNV-1a hash of the compiler version, the flags that affect the output and
+// the source bytes. An entry is the executable, named by the key in hex,
+// and its assembly next to it. A hit copies both out and skips the whole
+// pipeline.
+//
+// Entries are written under a temporary name and renamed into place, so
+// concurrent compilers never see half an entry. A hit bumps the entry's
+// modification time, and finish() evicts the least recently used entries
+// until the cache is within max_bytes, then adds this run's counters to the
+// totals kept in the cache's `stats` file.
+class CompileCache {
+public:
+	CompileCache(std::filesystem::path dir, const uint64_t max_bytes)
+		: m_dir(std::move(dir))
+		, m_max_bytes(max_bytes)
+	{
+		std::error_code ec;
+		std::filesystem::create_directories(m_dir, ec);
+		if (ec) {
+			std::cerr << "Unable to create cache directory " << m_dir.string() << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	[[nodiscard]] static std::string key(const std::string_view src, const std::string_view flags) {
+		using u128 = unsigned __int128;
+		constexpr u128 prime = (u128 { 1 } << 88) + 0x13b;
+		u128 hash = (u128 { 0x6c62272e07bb0142 } << 64) | 0x62b821756295c58d;
+		const auto mix = [&](const std::string_view bytes) {
+			for (const char c : bytes) {
+				hash ^= static_cast<unsigned char>(c);
+				hash *= prime;
+			}
+			// Field separator, so moving bytes between fields changes the key.
+			hash ^= 0xff;
+			hash *= prime;
+		};
+		mix(compiler_version);
+		mix(flags);
+		mix(src);
+		char hex[33];
+		std::snprintf(hex, sizeof(hex), "%016llx%016llx", static_cast<unsigned long long>(hash >> 64), static_cast<unsigned long long>(hash));
+		return hex;
+	}
+
+	// Copies the cached executable and assembly for `key` to exe and
+	// asm_path. False on a miss.
+	bool fetch(const std::string& key, const std::filesystem::path& exe, const std::filesystem::path& asm_path) {
+		const std::filesystem::path entry = m_dir / key;
+		std::error_code ec;
+		std::filesystem::copy_file(entry, exe, std::filesystem::copy_options::overwrite_existing, ec);
+		if (!ec) {
+			std::filesystem::copy_file(entry.string() + ".asm", asm_path, std::filesystem::copy_options::overwrite_existing, ec);
+		}
+		if (ec) {
+			m_misses.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		std::filesystem::last_write_time(entry, std::filesystem::file_time_type::clock::now(), ec);
+		m_hits.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	// Adds the executable at `exe` and its assembly under `key`.
+	void store(const std::string& key, const AsmBuffer& asm_text, const std::filesystem::path& exe) {
+		const std::filesystem::path entry = m_dir / key;
+		const std::string tmp = entry.string() + std::string(temp_marker) + std::to_string(::getpid()) + "_" + std::to_string(m_stores.fetch_add(1, std::memory_order_relaxed));
+		std::error_code ec;
+		asm_text.write_file((tmp + ".asm").c_str());
+		std::filesystem::copy_file(exe, tmp, std::filesystem::copy_options::overwrite_existing, ec);
+		// Both files are in the cache directory before either is renamed,
+		// and the executable goes in last: an entry exists once it does.
+		if (!ec) {
+			std::filesystem::rename(tmp + ".asm", entry.string() + ".asm", ec);
+		}
+		if (!ec) {
+			std::filesystem::rename(tmp, entry, ec);
+		}
+		if (ec) {
+			std::filesystem::remove(tmp, ec);
+			std::filesystem::remove(tmp + ".asm", ec);
+		}
+	}
+
+	void finish() {
+		evict();
+		const int fd = ::open((m_dir / "stats").c_str(), O_RDWR | O_CREAT, 0644);
+		if (fd < 0) {
+			return;
+		}
+		::flock(fd, LOCK_EX);
+		m_totals = read_totals(fd);
+		m_totals.hits += m_hits.load();
+		m_totals.misses += m_misses.load();
+		m_totals.evictions += m_evictions;
+		const std::string text = "hits " + std::to_string(m_totals.hits) + "\nmisses " + std::to_string(m_totals.misses)
+			+ "\nevictions " + std::to_string(m_totals.evictions) + "\n";
+		if (::ftruncate(fd, 0) == 0 && ::pwrite(fd, text.data(), text.size(), 0) < 0) {
+			std::cerr << "Unable to write cache stats" << std::endl;
+		}
+		::close(fd);
+	}
+
+	// This run's counters, then the cache's totals and size. Call after
+	// finish().
+	void report(std::ostream& out) const {
+		out << "cache " << m_dir.string() << std::endl;
+		out << "  this run  " << std::setw(8) << m_hits.load() << " hits " << std::setw(8) << m_misses.load() << " misses "
+			<< std::setw(6) << m_evictions << " evicted" << std::endl;
+		out << "  all runs  " << std::setw(8) << m_totals.hits << " hits " << std::setw(8) << m_totals.misses << " misses "
+			<< std::setw(6) << m_totals.evictions << " evicted" << std::endl;
+		out << "  " << m_entries << " entries, " << m_bytes << " of " << m_max_bytes << " bytes" << std::endl;
+	}
+
+private:
+	struct Totals {
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		uint64_t evictions = 0;
+	};
+
+	struct Entry {
+		std::filesystem::path exe;
+		std::filesystem::file_time_type used;
+		uint64_t bytes;
+	};
+
+	// An entry's executable and assembly are sized and evicted together.
+	// An assembly file whose executable is missing, left by a failed or
+	// interrupted store, is an entry of its own and ages out like the rest.
+	// Temporary files of processes that no longer run are removed.
+	void evict() {
+		std::unordered_map<std::string, Entry> by_key;
+		std::error_code ec;
+		for (const std::filesystem::directory_entry& file : std::filesystem::directory_iterator(m_dir, ec)) {
+			const std::filesystem::path& path = file.path();
+			std::error_code file_ec;
+			if (path.filename() == "stats" || !file.is_regular_file(file_ec)) {
+				continue;
+			}
+			const std::string name = path.filename().string();
+			if (const size_t marker = name.find(temp_marker); marker != std::string::npos) {
+				if (is_stale_temp(name, marker)) {
+					std::filesystem::remove(path, file_ec);
+				}
+				continue;
+			}
+			if (path.has_extension() && path.extension() != ".asm") {
+				continue;
+			}
+			const uint64_t bytes = file.file_size(file_ec);
+			if (file_ec) {
+				continue;
+			}
+			const std::filesystem::file_time_type used = file.last_write_time(file_ec);
+			if (file_ec) {
+				continue;
+			}
+			std::filesystem::path exe = path;
+			exe.replace_extension();
+			const auto [it, inserted] = by_key.try_emplace(exe.string(), Entry { exe, used, bytes });
+			if (!inserted) {
+				it->second.used = std::max(it->second.used, used);
+				it->second.bytes += bytes;
+			}
+		}
+		std::vector<Entry> entries;
+		entries.reserve(by_key.size());
+		for (auto& [key, entry] : by_key) {
+			entries.push_back(std::move(entry));
+		}
+		std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.used > b.used; });
+		m_bytes = 0;
+		m_entries = 0;
+		for (const Entry& entry : entries) {
+			if (m_bytes + entry.bytes <= m_max_bytes) {
+				m_bytes += entry.bytes;
+				m_entries++;
+				continue;
+			}
+			std::filesystem::remove(entry.exe, ec);
+			std::filesystem::remove(entry.exe.string() + ".asm", ec);
+			m_evictions++;
+		}
+	}
+
+	// Temporary files are named <key>.tmp<pid>_<n>[.asm]. Those of this
+	// process are stale too, as finish() runs after every store.
+	[[nodiscard]] static bool is_stale_temp(const std::string& name, const size_t marker) {
+		const pid_t pid = static_cast<pid_t>(std::strtol(name.c_str() + marker + temp_marker.size(), nullptr, 10));
+		if (pid <= 0 || pid == ::getpid()) {
+			return true;
+		}
+		return ::kill(pid, 0) != 0 && errno == ESRCH;
+	}
+
+	[[nodiscard]] static Totals read_totals(const int fd) {
+		std::string text(256, '\0');
+		const ssize_t n = ::pread(fd, text.data(), text.size(), 0);
+		text.resize(n > 0 ? static_cast<size_t>(n) : 0);
+		std::istringstream in(text);
+		Totals totals;
+		std::string name;
+		uint64_t value;
+		while (in >> name >> value) {
+			if (name == "hits") {
+				totals.hits = value;
+			} else if (name == "misses") {
+				totals.misses = value;
+			} else if (name == "evictions") {
+				totals.evictions = value;
+			}
+		}
+		return totals;
+	}
+
+	static constexpr std::string_view temp_marker = ".tmp";
+
+	const std::filesystem::path m_dir;
+	const uint64_t m_max_bytes;
+	std::atomic<uint64_t> m_hits { 0 };
+	std::atomic<uint64_t> m_misses { 0 };
+	std::atomic<uint64_t> m_stores { 0 };
+	uint64_t m_evictions = 0;
+	uint64_t m_entries = 0;
+	uint64_t m_bytes = 0;
+	Totals m_totals {};
+};
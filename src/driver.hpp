@@ -0,0 +1,197 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "./arena.hpp"
+#include "./cache.hpp"
+#include "./elf.hpp"
+#include "./emitter.hpp"
+#include "./fold.hpp"
+#include "./generation.hpp"
+#include "./inline.hpp"
+#include "./ir_lower.hpp"
+#include "./ir_passes.hpp"
+#include "./parser.hpp"
+#include "./source.hpp"
+#include "./thread_pool.hpp"
+#include "./tokenization.hpp"
+
+struct CompileOptions {
+	GenOptions gen {};
+	InlineOptions inlining {};
+	// Lower through the SSA IR instead of the AST Generator.
+	bool ir = false;
+	IrPassSet ir_passes = IrPassSet().set();
+	// Back the parser's arena with huge pages.
+	bool huge_pages = false;
+};
+
+// Runs the whole pipeline on `src` with no reporting. The tree is built in
+// `arena`, which is reset first so one arena serves a thread's successive
+// compilations; every other object it builds is local, so calls on
+// different threads with different arenas share nothing.
+[[nodiscard]] inline AsmBuffer compile_to_asm(const std::string_view src, const CompileOptions& options, ArenaAllocator& arena) {
+	arena.reset();
+	Tokenizer tokenizer(src);
+	Parser parser(tokenizer, arena);
+	std::optional<NodeProg> prog = parser.parse_prog();
+	if (!prog.has_value()) {
+		std::cerr << "Invalid program" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	Inliner(parser.arena(), options.inlining).run(prog.value());
+	ConstantFolder(parser.arena()).run(prog.value());
+	if (options.ir) {
+		IrModule module = IrBuilder::build(prog.value());
+		IrPipeline(options.ir_passes).run(module);
+		return IrLowering(options.gen.peephole_rules).lower(module);
+	}
+	Generator generator(std::move(prog.value()), options.gen);
+	return generator.gen_prog();
+}
+
+// Inputs listed one per line; blank lines and lines starting with '#' are
+// skipped.
+[[nodiscard]] inline std::vector<std::string> read_manifest(const char* path) {
+	std::ifstream file(path);
+	if (!file) {
+		std::cerr << "Unable to open " << path << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	std::vector<std::string> inputs;
+	std::string line;
+	while (std::getline(file, line)) {
+		if (!line.empty() && line.back() == '\r') {
+			line.pop_back();
+		}
+		if (!line.empty() && line.front() != '#') {
+			inputs.push_back(std::move(line));
+		}
+	}
+	return inputs;
+}
+
+struct BatchOptions {
+	CompileOptions compile {};
+	// Each input's .asm and executable go under this directory, at the
+	// input's path without its extension.
+	std::string out_dir = "output";
+	// Files compiled at once; 0 uses one thread per core.
+	size_t jobs = 0;
+	// Reused and filled when set; cache_flags are the output-affecting
+	// flags for its keys.
+	CompileCache* cache = nullptr;
+	std::string cache_flags {};
+};
+
+// Compiles every input in one process, one file per pool job, and prints a
+// summary. The compiler reports errors by exiting, so the first invalid
+// input ends the batch; the file being compiled is named on the way out.
+class BatchDriver {
+public:
+	static void run(const std::vector<std::string>& inputs, const BatchOptions& options) {
+		const std::vector<std::filesystem::path> outputs = output_paths(inputs, options.out_dir);
+		std::atexit(report_failed_input);
+		const auto start = std::chrono::steady_clock::now();
+
+		std::atomic<size_t> source_bytes { 0 };
+		std::atomic<size_t> asm_bytes { 0 };
+		std::atomic<size_t> code_bytes { 0 };
+		std::atomic<size_t> cached { 0 };
+		WorkStealingPool::run(inputs.size(), options.jobs, [&](const size_t i) {
+			t_current_input = inputs[i].c_str();
+			const SourceFile source(inputs[i].c_str());
+			source_bytes.fetch_add(source.view().size(), std::memory_order_relaxed);
+			const std::filesystem::path& out = outputs[i];
+			const std::filesystem::path out_asm = out.string() + ".asm";
+			std::filesystem::create_directories(out.parent_path());
+
+			std::string key;
+			if (options.cache != nullptr) {
+				key = CompileCache::key(source.view(), options.cache_flags);
+				if (options.cache->fetch(key, out, out_asm)) {
+					cached.fetch_add(1, std::memory_order_relaxed);
+					t_current_input = nullptr;
+					return;
+				}
+			}
+			if (!t_arena.has_value()) {
+				t_arena.emplace(Parser::default_arena_bytes, options.compile.huge_pages);
+			}
+			const AsmBuffer asm_text = compile_to_asm(source.view(), options.compile, *t_arena);
+			asm_text.write_file(out_asm.c_str());
+			ObjectCode obj = Assembler::assemble(asm_text.str());
+			code_bytes.fetch_add(obj.text.size(), std::memory_order_relaxed);
+			ElfWriter::write(out.c_str(), std::move(obj));
+			if (options.cache != nullptr) {
+				options.cache->store(key, asm_text, out);
+			}
+			asm_bytes.fetch_add(asm_text.size(), std::memory_order_relaxed);
+			t_current_input = nullptr;
+		});
+
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cout << "compiled " << inputs.size() << " files into " << options.out_dir;
+		if (options.cache != nullptr) {
+			std::cout << ", " << cached.load() << " from the cache";
+		}
+		std::cout << std::endl;
+		std::cout << "  source " << std::setw(12) << source_bytes.load() << " bytes" << std::endl;
+		std::cout << "  asm    " << std::setw(12) << asm_bytes.load() << " bytes" << std::endl;
+		std::cout << "  code   " << std::setw(12) << code_bytes.load() << " bytes" << std::endl;
+		std::cout << std::fixed << std::setprecision(3) << "  " << seconds * 1000.0 << " ms, "
+				  << std::setprecision(1) << static_cast<double>(inputs.size()) / seconds << " files/s" << std::endl;
+	}
+
+private:
+	// `input` without its extension, under `out_dir`. Root, "." and ".."
+	// components are dropped so nothing is written outside it.
+	[[nodiscard]] static std::filesystem::path output_path(const std::string& out_dir, const std::string& input) {
+		std::filesystem::path out = out_dir;
+		for (const std::filesystem::path& part : std::filesystem::path(input).relative_path()) {
+			if (part != "." && part != "..") {
+				out /= part;
+			}
+		}
+		return out.replace_extension();
+	}
+
+	// Two inputs with the same output, such as a.me and a.txt, would be
+	// written by two threads at once, so the batch is refused before it
+	// starts.
+	[[nodiscard]] static std::vector<std::filesystem::path> output_paths(const std::vector<std::string>& inputs, const std::string& out_dir) {
+		std::vector<std::filesystem::path> outputs;
+		outputs.reserve(inputs.size());
+		std::unordered_map<std::string, size_t> first_input;
+		for (size_t i = 0; i < inputs.size(); i++) {
+			outputs.push_back(output_path(out_dir, inputs[i]));
+			const auto [it, inserted] = first_input.emplace(outputs.back().lexically_normal().string(), i);
+			if (!inserted) {
+				std::cerr << "Inputs " << inputs[it->second] << " and " << inputs[i] << " both compile to " << outputs.back().string() << std::endl;
+				exit(EXIT_FAILURE);
+			}
+		}
+		return outputs;
+	}
+
+	// Runs on the thread that called exit().
+	static void report_failed_input() {
+		if (t_current_input != nullptr) {
+			std::cerr << "Batch stopped while compiling " << t_current_input << std::endl;
+		}
+	}
+
+	static inline thread_local const char* t_current_input = nullptr;
+	// Each pool thread's arena, kept across the files it compiles.
+	static inline thread_local std::optional<ArenaAllocator> t_arena {};
+};
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "./assembler.hpp"
+
+// Writes `obj` as a minimal static ELF64 executable: no section headers,
+// one R+X PT_LOAD for the code and one R+W PT_LOAD for .data followed by a
+// zero-filled .bss.
+class ElfWriter {
+public:
+	static constexpr uint64_t base_address = 0x400000;
+	static constexpr uint64_t page_size = 0x1000;
+
+	static void write(const char* path, ObjectCode obj) {
+		const uint64_t text_offset = page_size;
+		const uint64_t data_offset = align(text_offset + obj.text.size(), page_size);
+		const uint64_t text_address = base_address + text_offset;
+		const uint64_t data_address = base_address + data_offset;
+		obj.link(text_address, data_address);
+
+		Elf64_Ehdr header {};
+		std::memcpy(header.e_ident, ELFMAG, SELFMAG);
+		header.e_ident[EI_CLASS] = ELFCLASS64;
+		header.e_ident[EI_DATA] = ELFDATA2LSB;
+		header.e_ident[EI_VERSION] = EV_CURRENT;
+		header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+		header.e_type = ET_EXEC;
+		header.e_machine = EM_X86_64;
+		header.e_version = EV_CURRENT;
+		header.e_entry = obj.entry(text_address);
+		header.e_phoff = sizeof(Elf64_Ehdr);
+		header.e_ehsize = sizeof(Elf64_Ehdr);
+		header.e_phentsize = sizeof(Elf64_Phdr);
+		header.e_phnum = 2;
+
+		Elf64_Phdr text {};
+		text.p_type = PT_LOAD;
+		text.p_flags = PF_R | PF_X;
+		text.p_offset = text_offset;
+		text.p_vaddr = text_address;
+		text.p_paddr = text_address;
+		text.p_filesz = obj.text.size();
+		text.p_memsz = obj.text.size();
+		text.p_align = page_size;
+
+		Elf64_Phdr data {};
+		data.p_type = PT_LOAD;
+		data.p_flags = PF_R | PF_W;
+		data.p_offset = data_offset;
+		data.p_vaddr = data_address;
+		data.p_paddr = data_address;
+		data.p_filesz = obj.data.size();
+		data.p_memsz = obj.data.size() + obj.bss_size;
+		data.p_align = page_size;
+
+		std::vector<uint8_t> image(data_offset + obj.data.size(), 0);
+		std::memcpy(image.data(), &header, sizeof(header));
+		std::memcpy(image.data() + sizeof(header), &text, sizeof(text));
+		std::memcpy(image.data() + sizeof(header) + sizeof(text), &data, sizeof(data));
+		std::copy(obj.text.begin(), obj.text.end(), image.begin() + static_cast<std::ptrdiff_t>(text_offset));
+		std::copy(obj.data.begin(), obj.data.end(), image.begin() + static_cast<std::ptrdiff_t>(data_offset));
+
+		::unlink(path);
+		const int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+		if (fd < 0) {
+			std::cerr << "Unable to create " << path << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		size_t written = 0;
+		while (written < image.size()) {
+			const ssize_t n = ::write(fd, image.data() + written, image.size() - written);
+			if (n <= 0) {
+				std::cerr << "Unable to write " << path << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			written += static_cast<size_t>(n);
+		}
+		::close(fd);
+	}
+
+private:
+	static uint64_t align(const uint64_t value, const uint64_t alignment) {
+		return (value + alignment - 1) / alignment * alignment;
+	}
+};
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Append-only text buffer for generated assembly. Text goes into fixed-size
+// chunks that are never moved or reallocated, so appending is a bounds check
+// and a memcpy however large the program gets. The chunks are written out
+// with writev, and only copied into one string when a consumer needs the
+// text contiguous (the built-in assembler).
+class AsmBuffer {
+public:
+	static constexpr size_t chunk_size = 64 * 1024;
+
+	void append(std::string_view text) {
+		while (!text.empty()) {
+			if (m_chunks.empty() || m_chunks.back().size == chunk_size) {
+				m_chunks.push_back(Chunk { std::make_unique_for_overwrite<char[]>(chunk_size), 0 });
+			}
+			Chunk& chunk = m_chunks.back();
+			const size_t n = std::min(text.size(), chunk_size - chunk.size);
+			std::memcpy(chunk.data.get() + chunk.size, text.data(), n);
+			chunk.size += n;
+			m_size += n;
+			text.remove_prefix(n);
+		}
+	}
+
+	void append(const char c) {
+		append(std::string_view(&c, 1));
+	}
+
+	void append_int(const int64_t value) {
+		char digits[24];
+		const auto [end, ec] = std::to_chars(digits, digits + sizeof(digits), value);
+		append(std::string_view(digits, end));
+	}
+
+	[[nodiscard]] size_t size() const {
+		return m_size;
+	}
+
+	[[nodiscard]] std::string str() const {
+		std::string text;
+		text.reserve(m_size);
+		for (const Chunk& chunk : m_chunks) {
+			text.append(chunk.data.get(), chunk.size);
+		}
+		return text;
+	}
+
+	void write_file(const char* path) const {
+		const int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			std::cerr << "Unable to open " << path << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		std::vector<iovec> iov;
+		iov.reserve(m_chunks.size());
+		for (const Chunk& chunk : m_chunks) {
+			iov.push_back(iovec { chunk.data.get(), chunk.size });
+		}
+		// writev may stop early or take at most IOV_MAX entries; carry on
+		// from wherever it stopped.
+		size_t first = 0;
+		while (first < iov.size()) {
+			const int count = static_cast<int>(std::min<size_t>(iov.size() - first, IOV_MAX));
+			const ssize_t written = ::writev(fd, iov.data() + first, count);
+			if (written < 0) {
+				std::cerr << "Unable to write " << path << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			for (size_t n = static_cast<size_t>(written); n > 0;) {
+				const size_t step = std::min(n, iov[first].iov_len);
+				iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + step;
+				iov[first].iov_len -= step;
+				n -= step;
+				if (iov[first].iov_len == 0) {
+					first++;
+				}
+			}
+		}
+		::close(fd);
+	}
+
+private:
+	struct Chunk {
+		std::unique_ptr<char[]> data;
+		size_t size;
+	};
+
+	std::vector<Chunk> m_chunks {};
+	size_t m_size = 0;
+};
+
+// "QWORD [rsp + <bytes>]", formatted without going through a stream.
+[[nodiscard]] inline std::string stack_slot(const size_t bytes) {
+	char text[48] = "QWORD [rsp + ";
+	char* const digits = text + std::strlen(text);
+	char* const end = std::to_chars(digits, text + sizeof(text) - 1, bytes).ptr;
+	*end = ']';
+	return std::string(text, end + 1);
+}
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+#include "./parser.hpp"
+
+// Flat form of the expression trees in a NodeProg. Every expression is laid
+// out in postfix order in one contiguous node array; operands refer to each
+// other by 32-bit index and each node carries a single opcode tag, so code
+// generation is a linear walk instead of a pointer chase through variants.
+enum class FlatOp : uint8_t {
+	int_lit,
+	ident,
+	add,
+	sub,
+	mul,
+	div,
+	call
+};
+
+struct FlatExprNode {
+	FlatOp op;
+	// int_lit / ident: lhs indexes FlatAst::values and, for ident, rhs is the
+	// SymbolId. call: lhs indexes FlatAst::calls; the arguments are roots of
+	// their own. Binary ops: node indices of the operands.
+	uint32_t lhs;
+	uint32_t rhs;
+};
+
+// Half-open postfix range [begin, end); the root is the last node.
+struct FlatExpr {
+	uint32_t begin;
+	uint32_t end;
+};
+
+class FlatAst {
+public:
+	[[nodiscard]] static FlatAst build(const NodeProg& prog) {
+		FlatAst flat;
+		flat.add_stmts(prog.stmts);
+		return flat;
+	}
+
+	[[nodiscard]] const FlatExpr* find(const NodeExpr* expr) const {
+		const auto it = m_roots.find(expr);
+		return it == m_roots.end() ? nullptr : &it->second;
+	}
+
+	[[nodiscard]] std::span<const FlatExprNode> nodes(const FlatExpr& expr) const {
+		return { m_nodes.data() + expr.begin, expr.end - expr.begin };
+	}
+
+	[[nodiscard]] std::string_view value(const FlatExprNode& node) const {
+		return m_values[node.lhs];
+	}
+
+	[[nodiscard]] const NodeTermCall* call(const FlatExprNode& node) const {
+		return m_calls[node.lhs];
+	}
+
+	[[nodiscard]] size_t num_nodes() const {
+		return m_nodes.size();
+	}
+
+private:
+	void add_stmts(const std::pmr::vector<NodeStmt*>& stmts) {
+		for (const NodeStmt* stmt : stmts) {
+			add_stmt(stmt);
+		}
+	}
+
+	void add_stmt(const NodeStmt* stmt) {
+		struct StmtVisitor {
+			FlatAst* flat;
+			void operator()(const NodeStmtExit* stmt_exit) const {
+				flat->add_root(stmt_exit->expr);
+			}
+			void operator()(const NodeStmtLet* stmt_let) const {
+				flat->add_root(stmt_let->expr);
+			}
+			void operator()(const NodeStmtPrint* stmt_print) const {
+				flat->add_root(stmt_print->expr);
+			}
+			void operator()(const NodeScope* scope) const {
+				flat->add_stmts(scope->stmts);
+			}
+			void operator()(const NodeStmtIf* stmt_if) const {
+				flat->add_root(stmt_if->cond);
+				flat->add_stmts(stmt_if->scope->stmts);
+			}
+			void operator()(const NodeStmtFor* stmt_for) const {
+				flat->add_root(stmt_for->from);
+				flat->add_root(stmt_for->to);
+				flat->add_stmts(stmt_for->scope->stmts);
+			}
+			void operator()(const NodeStmtAssign* stmt_assign) const {
+				flat->add_root(stmt_assign->expr);
+			}
+			void operator()(const NodeStmtFunction* stmt_function) const {
+				flat->add_stmts(stmt_function->scope->stmts);
+			}
+			void operator()(const NodeStmtFunctionCall* stmt_call) const {
+				for (const NodeExpr* arg : stmt_call->args) {
+					flat->add_root(arg);
+				}
+			}
+			void operator()(const NodeStmtReturn* stmt_return) const {
+				flat->add_root(stmt_return->expr);
+			}
+		};
+		std::visit(StmtVisitor { this }, stmt->var);
+	}
+
+	// Call arguments are laid out after the expression that contains the
+	// call, so every root stays one contiguous range.
+	void add_root(const NodeExpr* expr) {
+		const auto begin = static_cast<uint32_t>(m_nodes.size());
+		const size_t first_call = m_calls.size();
+		add_expr(expr);
+		m_roots.emplace(expr, FlatExpr { begin, static_cast<uint32_t>(m_nodes.size()) });
+		const size_t last_call = m_calls.size();
+		for (size_t i = first_call; i < last_call; i++) {
+			for (const NodeExpr* arg : m_calls[i]->args) {
+				add_root(arg);
+			}
+		}
+	}
+
+	uint32_t add_expr(const NodeExpr* expr) {
+		struct ExprVisitor {
+			FlatAst* flat;
+			uint32_t operator()(const NodeTerm* term) const {
+				return flat->add_term(term);
+			}
+			uint32_t operator()(const NodeBinExpr* bin_expr) const {
+				return flat->add_bin_expr(bin_expr);
+			}
+		};
+		return std::visit(ExprVisitor { this }, expr->var);
+	}
+
+	uint32_t add_term(const NodeTerm* term) {
+		struct TermVisitor {
+			FlatAst* flat;
+			uint32_t operator()(const NodeTermIntLit* term_int_lit) const {
+				return flat->add_leaf(FlatOp::int_lit, term_int_lit->int_lit.value.value(), 0);
+			}
+			uint32_t operator()(const NodeTermIdent* term_ident) const {
+				return flat->add_leaf(FlatOp::ident, term_ident->ident.value.value(), term_ident->ident.symbol);
+			}
+			uint32_t operator()(const NodeTermParen* term_paren) const {
+				return flat->add_expr(term_paren->expr);
+			}
+			uint32_t operator()(const NodeTermCall* term_call) const {
+				flat->m_calls.push_back(term_call);
+				flat->m_nodes.push_back(FlatExprNode { FlatOp::call, static_cast<uint32_t>(flat->m_calls.size() - 1), 0 });
+				return static_cast<uint32_t>(flat->m_nodes.size() - 1);
+			}
+		};
+		return std::visit(TermVisitor { this }, term->var);
+	}
+
+	uint32_t add_bin_expr(const NodeBinExpr* bin_expr) {
+		struct BinExprVisitor {
+			FlatAst* flat;
+			uint32_t operator()(const NodeBinExprAdd* add) const {
+				return flat->add_op(FlatOp::add, add->lhs, add->rhs);
+			}
+			uint32_t operator()(const NodeBinExprMinus* sub) const {
+				return flat->add_op(FlatOp::sub, sub->lhs, sub->rhs);
+			}
+			uint32_t operator()(const NodeBinExprMulti* multi) const {
+				return flat->add_op(FlatOp::mul, multi->lhs, multi->rhs);
+			}
+			uint32_t operator()(const NodeBinExprDiv* div) const {
+				return flat->add_op(FlatOp::div, div->lhs, div->rhs);
+			}
+		};
+		return std::visit(BinExprVisitor { this }, bin_expr->var);
+	}
+
+	uint32_t add_leaf(const FlatOp op, const std::string_view value, const uint32_t symbol) {
+		m_values.push_back(value);
+		m_nodes.push_back(FlatExprNode { op, static_cast<uint32_t>(m_values.size() - 1), symbol });
+		return static_cast<uint32_t>(m_nodes.size() - 1);
+	}
+
+	uint32_t add_op(const FlatOp op, const NodeExpr* lhs, const NodeExpr* rhs) {
+		const uint32_t lhs_index = add_expr(lhs);
+		const uint32_t rhs_index = add_expr(rhs);
+		m_nodes.push_back(FlatExprNode { op, lhs_index, rhs_index });
+		return static_cast<uint32_t>(m_nodes.size() - 1);
+	}
+
+	std::vector<FlatExprNode> m_nodes {};
+	std::vector<std::string_view> m_values {};
+	std::vector<const NodeTermCall*> m_calls {};
+	std::unordered_map<const NodeExpr*, FlatExpr> m_roots {};
+};
@@ -0,0 +1,335 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+#include "./arena.hpp"
+#include "./parser.hpp"
+#include "./symbols.hpp"
+
+// Value of an expression or variable at compile time. top is "no
+// information yet", bottom is "not a constant"; meet moves down only.
+struct ConstLattice {
+	enum class Kind : uint8_t {
+		top,
+		constant,
+		bottom
+	};
+
+	Kind kind = Kind::top;
+	int64_t value = 0;
+
+	[[nodiscard]] static ConstLattice constant(const int64_t value) {
+		return { Kind::constant, value };
+	}
+
+	[[nodiscard]] static ConstLattice bottom() {
+		return { Kind::bottom, 0 };
+	}
+
+	[[nodiscard]] bool is_constant() const {
+		return kind == Kind::constant;
+	}
+
+	[[nodiscard]] ConstLattice meet(const ConstLattice other) const {
+		if (kind == Kind::top) {
+			return other;
+		}
+		if (other.kind == Kind::top) {
+			return *this;
+		}
+		if (is_constant() && other.is_constant() && value == other.value) {
+			return *this;
+		}
+		return bottom();
+	}
+};
+
+// Returns the literal token when `expr` is (after folding) a plain integer.
+[[nodiscard]] inline const Token* as_int_lit(const NodeExpr* expr) {
+	const auto* term = std::get_if<NodeTerm*>(&expr->var);
+	if (term == nullptr) {
+		return nullptr;
+	}
+	const auto* int_lit = std::get_if<NodeTermIntLit*>(&(*term)->var);
+	return int_lit == nullptr ? nullptr : &(*int_lit)->int_lit;
+}
+
+// Literals that do not fit in 64 bits are not constants.
+[[nodiscard]] inline std::optional<int64_t> parse_int_lit(const std::string_view text) {
+	int64_t value = 0;
+	const auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+	if (ec != std::errc {} || end != text.data() + text.size()) {
+		return std::nullopt;
+	}
+	return value;
+}
+
+// Folds constant subexpressions and propagates the values of constant
+// variables into their uses, rewriting each constant NodeExpr in place into
+// an integer literal. Arithmetic wraps at 64 bits and divides unsigned,
+// like the generated code; division by zero is left for run time.
+//
+// Control flow is structured, so the analysis is a single walk: a variable
+// assigned inside an if body meets its value from before the if, and one
+// assigned inside a loop body is not a constant inside or after the loop.
+// Function bodies see every outer variable as bottom, and a call makes
+// every variable any function body assigns bottom.
+class ConstantFolder {
+public:
+	explicit ConstantFolder(ArenaAllocator& allocator)
+		: m_allocator(allocator)
+	{
+	}
+
+	void run(NodeProg& prog) {
+		fold_stmts(prog.stmts);
+	}
+
+	[[nodiscard]] size_t num_folded() const {
+		return m_num_folded;
+	}
+
+private:
+	void fold_stmts(const std::pmr::vector<NodeStmt*>& stmts) {
+		for (NodeStmt* stmt : stmts) {
+			fold_stmt(stmt);
+		}
+	}
+
+	void fold_stmt(NodeStmt* stmt) {
+		struct StmtVisitor {
+			ConstantFolder* folder;
+			void operator()(NodeStmtExit* stmt_exit) const {
+				folder->fold_expr(stmt_exit->expr);
+			}
+			void operator()(NodeStmtLet* stmt_let) const {
+				folder->m_vars.bind(stmt_let->ident.symbol, folder->fold_expr(stmt_let->expr));
+			}
+			void operator()(NodeStmtPrint* stmt_print) const {
+				folder->fold_expr(stmt_print->expr);
+			}
+			void operator()(NodeScope* scope) const {
+				folder->m_vars.begin_scope();
+				folder->fold_stmts(scope->stmts);
+				folder->m_vars.end_scope();
+			}
+			void operator()(NodeStmtIf* stmt_if) const {
+				folder->fold_expr(stmt_if->cond);
+				std::vector<SymbolId> assigned;
+				folder->collect_assigned(stmt_if->scope->stmts, assigned);
+				std::vector<ConstLattice> before;
+				for (const SymbolId symbol : assigned) {
+					const ConstLattice* value = folder->m_vars.find(symbol);
+					before.push_back(value == nullptr ? ConstLattice::bottom() : *value);
+				}
+				folder->fold_stmts(stmt_if->scope->stmts);
+				for (size_t i = 0; i < assigned.size(); i++) {
+					if (ConstLattice* value = folder->m_vars.find(assigned[i])) {
+						*value = value->meet(before[i]);
+					}
+				}
+			}
+			void operator()(NodeStmtFor* stmt_for) const {
+				folder->fold_expr(stmt_for->from);
+				folder->fold_expr(stmt_for->to);
+				std::vector<SymbolId> assigned;
+				folder->collect_assigned(stmt_for->scope->stmts, assigned);
+				folder->make_bottom(assigned);
+				folder->fold_stmts(stmt_for->scope->stmts);
+				folder->make_bottom(assigned);
+			}
+			void operator()(NodeStmtAssign* stmt_assign) const {
+				const ConstLattice value = folder->fold_expr(stmt_assign->expr);
+				if (ConstLattice* var = folder->m_vars.find(stmt_assign->ident.symbol)) {
+					*var = value;
+				}
+			}
+			void operator()(NodeStmtFunction* stmt_function) const {
+				ScopedSymbolTable<ConstLattice> outer = std::exchange(folder->m_vars, {});
+				folder->fold_stmts(stmt_function->scope->stmts);
+				folder->m_vars = std::move(outer);
+				folder->collect_assigned(stmt_function->scope->stmts, folder->m_call_clobbers);
+			}
+			void operator()(NodeStmtFunctionCall* stmt_call) const {
+				folder->fold_call(stmt_call->args);
+			}
+			void operator()(NodeStmtReturn* stmt_return) const {
+				folder->fold_expr(stmt_return->expr);
+			}
+		};
+		std::visit(StmtVisitor { this }, stmt->var);
+	}
+
+	// Symbols a `let` or assignment in `stmts` may change, including
+	// through calls.
+	void collect_assigned(const std::pmr::vector<NodeStmt*>& stmts, std::vector<SymbolId>& out) const {
+		struct StmtVisitor {
+			const ConstantFolder* folder;
+			std::vector<SymbolId>& out;
+			void operator()(const NodeStmtLet* stmt_let) const {
+				out.push_back(stmt_let->ident.symbol);
+			}
+			void operator()(const NodeStmtAssign* stmt_assign) const {
+				out.push_back(stmt_assign->ident.symbol);
+			}
+			void operator()(const NodeScope* scope) const {
+				folder->collect_assigned(scope->stmts, out);
+			}
+			void operator()(const NodeStmtIf* stmt_if) const {
+				folder->collect_assigned(stmt_if->scope->stmts, out);
+			}
+			void operator()(const NodeStmtFor* stmt_for) const {
+				folder->collect_assigned(stmt_for->scope->stmts, out);
+			}
+			void operator()(const NodeStmtFunctionCall*) const {
+				out.insert(out.end(), folder->m_call_clobbers.begin(), folder->m_call_clobbers.end());
+			}
+			void operator()(const NodeStmtExit*) const {
+			}
+			void operator()(const NodeStmtPrint*) const {
+			}
+			void operator()(const NodeStmtFunction*) const {
+			}
+			void operator()(const NodeStmtReturn*) const {
+			}
+		};
+		for (const NodeStmt* stmt : stmts) {
+			std::visit(StmtVisitor { this, out }, stmt->var);
+		}
+	}
+
+	void fold_call(const std::pmr::vector<NodeExpr*>& args) {
+		for (NodeExpr* arg : args) {
+			fold_expr(arg);
+		}
+		make_bottom(m_call_clobbers);
+	}
+
+	void make_bottom(const std::vector<SymbolId>& symbols) {
+		for (const SymbolId symbol : symbols) {
+			if (ConstLattice* value = m_vars.find(symbol)) {
+				*value = ConstLattice::bottom();
+			}
+		}
+	}
+
+	// Folds `expr` and, if it is constant, replaces it with a literal.
+	ConstLattice fold_expr(NodeExpr* expr) {
+		const ConstLattice value = eval_expr(expr);
+		if (value.is_constant() && as_int_lit(expr) == nullptr) {
+			expr->var = make_int_lit(value.value);
+			m_num_folded++;
+		}
+		return value;
+	}
+
+	ConstLattice eval_expr(NodeExpr* expr) {
+		struct ExprVisitor {
+			ConstantFolder* folder;
+			ConstLattice operator()(NodeTerm* term) const {
+				return folder->eval_term(term);
+			}
+			ConstLattice operator()(NodeBinExpr* bin_expr) const {
+				return folder->eval_bin_expr(bin_expr);
+			}
+		};
+		return std::visit(ExprVisitor { this }, expr->var);
+	}
+
+	ConstLattice eval_term(NodeTerm* term) {
+		struct TermVisitor {
+			ConstantFolder* folder;
+			ConstLattice operator()(NodeTermIntLit* term_int_lit) const {
+				const std::optional<int64_t> value = parse_int_lit(term_int_lit->int_lit.value.value());
+				return value.has_value() ? ConstLattice::constant(*value) : ConstLattice::bottom();
+			}
+			ConstLattice operator()(NodeTermIdent* term_ident) const {
+				const ConstLattice* value = folder->m_vars.find(term_ident->ident.symbol);
+				return value == nullptr ? ConstLattice::bottom() : *value;
+			}
+			ConstLattice operator()(NodeTermParen* term_paren) const {
+				return folder->fold_expr(term_paren->expr);
+			}
+			ConstLattice operator()(NodeTermCall* term_call) const {
+				folder->fold_call(term_call->args);
+				return ConstLattice::bottom();
+			}
+		};
+		return std::visit(TermVisitor { this }, term->var);
+	}
+
+	ConstLattice eval_bin_expr(NodeBinExpr* bin_expr) {
+		enum class Op {
+			add,
+			sub,
+			mul,
+			div
+		};
+		struct BinExprVisitor {
+			Op& op;
+			NodeExpr*& lhs;
+			NodeExpr*& rhs;
+			void operator()(NodeBinExprAdd* add) const {
+				op = Op::add, lhs = add->lhs, rhs = add->rhs;
+			}
+			void operator()(NodeBinExprMinus* sub) const {
+				op = Op::sub, lhs = sub->lhs, rhs = sub->rhs;
+			}
+			void operator()(NodeBinExprMulti* multi) const {
+				op = Op::mul, lhs = multi->lhs, rhs = multi->rhs;
+			}
+			void operator()(NodeBinExprDiv* div) const {
+				op = Op::div, lhs = div->lhs, rhs = div->rhs;
+			}
+		};
+		Op op {};
+		NodeExpr* lhs_expr = nullptr;
+		NodeExpr* rhs_expr = nullptr;
+		std::visit(BinExprVisitor { op, lhs_expr, rhs_expr }, bin_expr->var);
+
+		// Both sides are folded even when the other is not constant.
+		const ConstLattice lhs = fold_expr(lhs_expr);
+		const ConstLattice rhs = fold_expr(rhs_expr);
+		if (!lhs.is_constant() || !rhs.is_constant()) {
+			return ConstLattice::bottom();
+		}
+		const auto a = static_cast<uint64_t>(lhs.value);
+		const auto b = static_cast<uint64_t>(rhs.value);
+		switch (op) {
+		case Op::add:
+			return ConstLattice::constant(static_cast<int64_t>(a + b));
+		case Op::sub:
+			return ConstLattice::constant(static_cast<int64_t>(a - b));
+		case Op::mul:
+			return ConstLattice::constant(static_cast<int64_t>(a * b));
+		case Op::div:
+			if (b == 0) {
+				return ConstLattice::bottom();
+			}
+			return ConstLattice::constant(static_cast<int64_t>(a / b));
+		}
+		return ConstLattice::bottom();
+	}
+
+	NodeTerm* make_int_lit(const int64_t value) {
+		char buffer[24];
+		const auto [end, ec] = std::to_chars(buffer, buffer + sizeof(buffer), value);
+		const auto size = static_cast<size_t>(end - buffer);
+		auto* text = static_cast<char*>(m_allocator.alloc_bytes(size, 1));
+		std::memcpy(text, buffer, size);
+
+		auto* term_int_lit = m_allocator.emplace<NodeTermIntLit>(Token { TokenType::int_lit, std::string_view(text, size) });
+		return m_allocator.emplace<NodeTerm>(term_int_lit);
+	}
+
+	ArenaAllocator& m_allocator;
+	ScopedSymbolTable<ConstLattice> m_vars {};
+	std::vector<SymbolId> m_call_clobbers {};
+	size_t m_num_folded = 0;
+};
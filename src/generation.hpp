@@ -1,479 +1,858 @@
 #pragma once
 
 #include "parser.hpp"
+#include "flat_ast.hpp"
+#include "fold.hpp"
+#include "emitter.hpp"
+#include "instructions.hpp"
+#include "peephole.hpp"
+#include "runtime.hpp"
+#include "strength.hpp"
+#include "symbols.hpp"
+#include "thread_pool.hpp"
+#include <array>
 #include <cassert>
 #include <map>
+#include <memory>
 #include <algorithm>
 #include <ranges>
-
+#include <span>
+
+struct GenOptions {
+	// Evaluate expressions with the original push/pop stack machine instead
+	// of in registers.
+	bool stack_exprs = false;
+	// With stack_exprs, lower expressions through FlatAst instead of walking
+	// the pointer tree. Register code is always generated from FlatAst.
+	bool flat_ast = false;
+	// for loops with a constant trip count up to this many iterations are
+	// unrolled; 0 never unrolls.
+	size_t unroll_limit = 0;
+	// Turn register-path * and / by a constant into shifts, lea and
+	// multiply-high sequences.
+	bool strength_reduce = true;
+	// Peephole rules to run over the instruction lists before rendering.
+	PeepholeRuleSet peephole_rules = PeepholeRuleSet().set();
+	// Threads to generate function bodies on; 0 uses one per core. With
+	// more than one, a function that declares no functions of its own is
+	// generated after the top level, on the pool, with its labels prefixed
+	// by the function's label. The output does not depend on the count.
+	size_t jobs = 1;
+};
+
+// Expects a NodeProg that has been through ConstantFolder: for-loop bounds
+// are read from folded literals.
 class Generator {
 public:
-	inline explicit Generator(NodeProg prog)
-		: m_prog(std::move(prog)) { }
+	inline explicit Generator(NodeProg prog, const GenOptions options = {})
+		: m_prog(std::move(prog))
+		, m_reg_exprs(!options.stack_exprs)
+		, m_unroll_limit(options.unroll_limit)
+		, m_strength_reduce(options.strength_reduce)
+		, m_jobs(options.jobs)
+		, m_peephole(options.peephole_rules)
+	{
+		if (m_reg_exprs || options.flat_ast) {
+			m_flat = std::make_shared<const FlatAst>(FlatAst::build(m_prog));
+		}
+	}
 
-	void gen_term(const NodeTerm* term, const bool is_function = false) {
+	void gen_term(const NodeTerm* term) {
 		struct TermVisitor {
 			Generator* gen;
-			bool is_function;
 			void operator()(const NodeTermIntLit* term_int_lit) const {
-				if(is_function) {
-					gen->m_functions_output << "\tmov rax, " << term_int_lit->int_lit.value.value() << "\n";
-				} else {
-					gen->m_output << "\tmov rax, " << term_int_lit->int_lit.value.value() << "\n";
-				}
-				gen->push("rax", is_function);
+				gen->section().emit("mov", "rax", std::string(term_int_lit->int_lit.value.value()));
+				gen->push("rax");
 			}
 			void operator()(const NodeTermIdent* term_ident) const {
-				auto it = std::find_if(gen->m_vars.cbegin(), gen->m_vars.cend(), [&](const Var& var) { return var.name == term_ident->ident.value.value(); });
-				if (it == gen->m_vars.cend()) {
-					std::cerr << "Undeclared identifier: " << term_ident->ident.value.value() << std::endl;
-					exit(EXIT_FAILURE);
-				}
-				std::stringstream offset;
-				offset << "QWORD [rsp + " << (gen->m_stack_size - (*it).stack_loc - 1) * 8 << "]";
-				gen->push(offset.str(), is_function);
+				gen->push_var(term_ident->ident.symbol, term_ident->ident.value.value());
 			}
 			void operator()(const NodeTermParen* term_paren) const {
-				gen->gen_expr(term_paren->expr, is_function);
+				gen->gen_expr(term_paren->expr);
+			}
+			void operator()(const NodeTermCall* term_call) const {
+				gen->gen_call(term_call->ident, term_call->args);
+				gen->push("rax");
 			}
 		};
-		TermVisitor visitor({ this, is_function });
+		TermVisitor visitor({ this });
 		std::visit(visitor, term->var);
 	}
 
-	void genBinExpr(const NodeBinExpr* bin_expr, const bool is_function = false) {
+	void genBinExpr(const NodeBinExpr* bin_expr) {
 		struct BinExprVisitor {
 			Generator* gen;
-			bool is_function;
 			void operator()(const NodeBinExprAdd* bin_expr_add) const {
-				gen->gen_expr(bin_expr_add->lhs, is_function);
-				gen->gen_expr(bin_expr_add->rhs, is_function);
-				gen->pop("rax", is_function);
-				gen->pop("rbx", is_function);
-				if(is_function) {
-					gen->m_functions_output << "\tadd rax, rbx\n";
-				} else {
-					gen->m_output << "\tadd rax, rbx\n";
-				}
-				gen->push("rax", is_function);
+				gen->gen_expr(bin_expr_add->lhs);
+				gen->gen_expr(bin_expr_add->rhs);
+				gen->pop("rbx");
+				gen->pop("rax");
+				gen->section().emit("add", "rax", "rbx");
+				gen->push("rax");
 			}
 			void operator()(const NodeBinExprMinus* bin_expr_sub) const {
-				gen->gen_expr(bin_expr_sub->lhs, is_function);
-				gen->gen_expr(bin_expr_sub->rhs, is_function);
-				gen->pop("rax", is_function);
-				gen->pop("rbx", is_function);
-				if(is_function) {
-					gen->m_functions_output << "\tsub rax, rbx\n";
-				} else {
-					gen->m_output << "\tsub rax, rbx\n";
-				}
-				gen->push("rax", is_function);
+				gen->gen_expr(bin_expr_sub->lhs);
+				gen->gen_expr(bin_expr_sub->rhs);
+				gen->pop("rbx");
+				gen->pop("rax");
+				gen->section().emit("sub", "rax", "rbx");
+				gen->push("rax");
 			}
 			void operator()(const NodeBinExprMulti* bin_expr_multi) const {
-				gen->gen_expr(bin_expr_multi->lhs, is_function);
-				gen->gen_expr(bin_expr_multi->rhs, is_function);
-				gen->pop("rax", is_function);
-				gen->pop("rbx", is_function);
-				if (is_function) {
-					gen->m_functions_output << "\tmul rbx\n";
-				} else {
-					gen->m_output << "\tmul rbx\n";
-				}
-				gen->push("rax", is_function);
+				gen->gen_expr(bin_expr_multi->lhs);
+				gen->gen_expr(bin_expr_multi->rhs);
+				gen->pop("rbx");
+				gen->pop("rax");
+				gen->section().emit("mul", "rbx");
+				gen->push("rax");
 			}
 			void operator()(const NodeBinExprDiv* bin_expr_div) const {
-				gen->gen_expr(bin_expr_div->lhs, is_function);
-				gen->gen_expr(bin_expr_div->rhs, is_function);
-				gen->pop("rax", is_function);
-				gen->pop("rbx", is_function);
-				if (is_function) {
-					gen->m_functions_output << "\tdiv rbx\n";
-				} else {
-					gen->m_output << "\tdiv rbx\n";
-				}
-				gen->push("rax", is_function);
+				gen->gen_expr(bin_expr_div->lhs);
+				gen->gen_expr(bin_expr_div->rhs);
+				gen->pop("rbx");
+				gen->pop("rax");
+				gen->section().emit("xor", "edx", "edx");
+				gen->section().emit("div", "rbx");
+				gen->push("rax");
 			}
 		};
 
-		BinExprVisitor visitor { this, is_function };
+		BinExprVisitor visitor { this };
 		std::visit(visitor, bin_expr->var);
 	}
 
-	void gen_expr(const NodeExpr* expr, const bool is_function = false) {
+	void gen_expr(const NodeExpr* expr) {
+		if (m_flat != nullptr) {
+			if (const FlatExpr* flat = m_flat->find(expr)) {
+				if (m_reg_exprs) {
+					gen_reg_expr(*flat);
+				} else {
+					gen_flat_expr(*flat);
+				}
+				return;
+			}
+		}
+
 		struct ExprVisitor {
 			Generator* gen;
-			bool is_function;
 			void operator()(const NodeTerm* term) const {
-				gen->gen_term(term, is_function);
+				gen->gen_term(term);
 			}
 			void operator()(const NodeBinExpr* bin_expr) const {
-				gen->genBinExpr(bin_expr, is_function);
+				gen->genBinExpr(bin_expr);
 			}
 		};
 
-		ExprVisitor visitor { this, is_function };
+		ExprVisitor visitor { this };
 		std::visit(visitor, expr->var);
 	}
 
-	void gen_stmt(const NodeStmt* stmt, const bool is_function = false) {
+	void gen_stmt(const NodeStmt* stmt) {
 		struct StmtVisitor {
 			Generator* gen;
-			bool is_function;
 			void operator()(const NodeStmtExit* stmt_exit) const {
 				gen->m_is_exiting = true;
-				gen->gen_expr(stmt_exit->expr, is_function);
-				if(is_function) {
-					gen->m_functions_output << "\tmov rax, 60\n";
-					gen->pop("rdi", true);
-					gen->m_functions_output << "\tsyscall\n";
-				} else {
-					gen->m_output << "\tmov rax, 60\n";
-					gen->pop("rdi");
-					gen->m_output << "\tsyscall\n";
-				}
+				gen->gen_expr(stmt_exit->expr);
+				gen->pop("rdi");
+				gen->section().emit("call", "mine_exit");
 			}
 			void operator()(const NodeStmtLet* stmt_let) const {
-				auto it = std::find_if(gen->m_vars.cbegin(), gen->m_vars.cend(), [&](const Var& var) { return var.name == stmt_let->ident.value.value(); });
-				if (it != gen->m_vars.cend()) {
+				if (gen->m_vars.find(stmt_let->ident.symbol) != nullptr) {
 					std::cerr << "Identifier already used: " << stmt_let->ident.value.value() << std::endl;
 					exit(EXIT_FAILURE);
 				}
-				gen->m_vars.push_back(Var { gen->m_stack_size, stmt_let->ident.value.value(), gen->gen_expr_to_str(stmt_let->expr) });
-				gen->gen_expr(stmt_let->expr, is_function);
+				gen->m_vars.bind(stmt_let->ident.symbol, Var { gen->m_stack_size });
+				gen->gen_expr(stmt_let->expr);
 			}
 			void operator()(const NodeStmtPrint* stmt_print) const {
-				gen->gen_expr(stmt_print->expr, is_function);
-				gen->pop("rax", is_function);
-
-				if(is_function) {
-					gen->m_functions_output << "\tadd rax, '0'\n";
-					gen->m_functions_output << "\tmov [message" << gen->m_data_counter << "], rax\n";
-					gen->m_functions_output << "\tmov BYTE [message" << gen->m_data_counter << " + 1], 0xA\n";
-					gen->m_functions_output << "\tmov rax, 1\n"; // sys_write code
-					gen->m_functions_output << "\tmov rdi, 1\n"; // stdout
-					gen->m_functions_output << "\tmov rsi, message" << gen->m_data_counter << "\n";
-					gen->m_functions_output << "\tmov rdx, msg_len" << gen->m_data_counter << "\n";
-					gen->m_functions_output << "\tsyscall\n";
-				} else {
-					gen->m_output << "\tadd rax, '0'\n";
-					gen->m_output << "\tmov [message0], rax\n";
-					gen->m_output << "\tmov BYTE [message0 + 1], 0xA\n";
-					gen->m_output << "\tmov rax, 1\n"; // sys_write code
-					gen->m_output << "\tmov rdi, 1\n"; // stdout
-					gen->m_output << "\tmov rsi, message" << gen->m_data_counter << "\n";
-					gen->m_output << "\tmov rdx, msg_len" << gen->m_data_counter << "\n";
-					gen->m_output << "\tsyscall\n";
-				}
-
-
-				std::string expr_str = gen->gen_expr_to_str(stmt_print->expr);
-				gen->m_data << "\tmessage" << gen->m_data_counter << " db \"" << expr_str << "\", 0xA\n";
-				gen->m_data << "\tmsg_len" << gen->m_data_counter << " equ $ - message" << gen->m_data_counter << "\n";
-				gen->m_data_counter++;
+				gen->gen_expr(stmt_print->expr);
+				gen->pop("rdi");
+				gen->section().emit("call", "mine_print_int");
 			}
 			void operator()(const NodeScope* stmt_scope) const {
 				gen->begin_scope();
 
 				for (const NodeStmt* stmt : stmt_scope->stmts) {
-					gen->gen_stmt(stmt, is_function);
+					gen->gen_stmt(stmt);
 				}
 
-				gen->end_scope(is_function);
+				gen->end_scope();
 			}
 			void operator()(const NodeStmtIf* stmt_if) const {
-				gen->gen_expr(stmt_if->cond, is_function);
-				gen->pop("rax", is_function);
-				if(is_function) {
-					gen->m_functions_output << "\tcmp rax, 0\n";
-					gen->m_functions_output << "\tje .if_end_" << gen->m_if_counter << "\n";
-				} else {
-					gen->m_output << "\tcmp rax, 0\n";
-					gen->m_output << "\tje .if_end_" + std::to_string(gen->m_if_counter) + "\n";
-				}
+				// Not a NASM local label: loop labels inside the body would
+				// start a new scope for it.
+				const std::string if_end = gen->m_label_prefix + "if_end_" + std::to_string(gen->m_if_counter++);
+				gen->gen_expr(stmt_if->cond);
+				gen->pop("rax");
+				gen->section().emit("cmp", "rax", "0");
+				gen->section().emit("je", if_end);
+				// The body's locals are only pushed when it runs, so they are
+				// dropped before the join.
+				gen->begin_scope();
 				for (const NodeStmt* stmt : stmt_if->scope->stmts) {
-					gen->gen_stmt(stmt, is_function);
+					gen->gen_stmt(stmt);
 				}
-				gen->create_label(".if_end_" + std::to_string(gen->m_if_counter), is_function);
-				gen->m_if_counter++;
+				gen->end_scope();
+				gen->create_label(if_end);
 			}
 			void operator()(const NodeStmtFor* stmt_for) const {
-				std::string from = gen->gen_expr_to_str(stmt_for->from);
-				std::string to = gen->gen_expr_to_str(stmt_for->to);
-				int counter = std::stoi(to) - std::stoi(from);
-				gen->m_for_counter++;
-				const int local_for_counter = gen->m_for_counter;
-
-
-				if(is_function) {
-					gen->m_functions_output << "\tmov r8, " << counter << "\n";
-					gen->create_label("startloop_" + std::to_string(local_for_counter), true);
-
-					gen->m_functions_output << "\tcmp r8, 0\n";
-					gen->m_functions_output << "\tjz endloop_" << local_for_counter << "\n";
-					gen->push("r8", true);
-
-					gen->create_label("loop_content_" + std::to_string(local_for_counter), true);
-
-					gen->pop("r8", true);
-				} else {
-					gen->m_output << "\tmov r8, " << counter << "\n";
-					gen->create_label("startloop_" + std::to_string(local_for_counter));
-
-					gen->m_output << "\tcmp r8, 0\n";
-					gen->m_output << "\tjz endloop_" << local_for_counter << "\n";
-					gen->push("r8");
-
-					gen->create_label("loop_content_" + std::to_string(local_for_counter));
-
-					gen->pop("r8", is_function);
-				}
-				for (const NodeStmt* stmt : stmt_for->scope->stmts) {
-					gen->gen_stmt(stmt, is_function);
-				}
-				gen->push("r8", is_function);
-
-				gen->create_label("end_of_loop_content_" + std::to_string(local_for_counter), is_function);
-
-				if(is_function) {
-					gen->pop("r8", true);
-					gen->m_functions_output << "\tdec r8\n";
-					gen->m_output << "\tjmp startloop_" << local_for_counter << "\n";
-				} else {
-					gen->pop("r8");
-					gen->m_output << "\tdec r8\n";
-					gen->m_output << "\tjmp startloop_" << local_for_counter << "\n";
-				}
-
-				gen->create_label("endloop_" + std::to_string(local_for_counter), is_function);
+				gen->gen_for(stmt_for);
 			}
 			void operator()(const NodeStmtAssign* stmt_assign) const {
-				const auto it = std::ranges::find_if(gen->m_vars, [&](const Var& var) {
-					return var.name == stmt_assign->ident.value.value();
-				});
-				if (it == gen->m_vars.end()) {
+				const Var* it = gen->m_vars.find(stmt_assign->ident.symbol);
+				if (it == nullptr) {
 					std::cerr << "Undeclared identifier: " << stmt_assign->ident.value.value() << std::endl;
 					exit(EXIT_FAILURE);
 				}
-				gen->gen_expr(stmt_assign->expr, is_function);
-				gen->pop("rax", is_function);
-				if(is_function) {
-					gen->m_functions_output << "\tmov [rsp + " << (gen->m_stack_size - it->stack_loc - 1) * 8 << "], rax\n";
-				} else {
-					gen->m_output << "\tmov [rsp + " << (gen->m_stack_size - it->stack_loc - 1) * 8 << "], rax\n";
-				}
+				gen->gen_expr(stmt_assign->expr);
+				gen->pop("rax");
+				gen->section().emit("mov", stack_slot((gen->m_stack_size - it->stack_loc - 1) * 8), "rax");
 			}
-			void operator()(const NodeStmtFunction* stmt_function_declaration) const {
-				const auto it = std::ranges::find_if(gen->m_functions, [&](const Func& func) {
-					return func.name == stmt_function_declaration->ident.value.value();
-				});
-				if (it != gen->m_functions.end()) {
-					std::cerr << "Already declared function identifier: " << it->name << std::endl;
-					exit(EXIT_FAILURE);
-				}
-
-				gen->m_functions.push_back(Func { stmt_function_declaration->ident.value.value(), stmt_function_declaration->ident.value.value() + "_" + std::to_string(gen->m_func_counter), {} });
-
-
-				gen->m_functions_output << stmt_function_declaration->ident.value.value() << "_" << gen->m_func_counter << ":\n";
-
-				for(int i = 0; i < stmt_function_declaration->args.size(); i++) {
-					gen->pop("r" + std::to_string(i + 8), true);
-				}
-
-				for (const NodeStmt* stmt : stmt_function_declaration->scope->stmts) {
-					gen->gen_stmt(stmt, true);
-				}
-
-				// std::replace(gen->m_functions_output.str().begin(), gen->m_functions_output.str().end(), 'x', stmt_function_declaration->args[0]->var.value.value()[0]);
-
-				gen->m_functions_output << "\tret\n";
-				gen->m_func_counter++;
+			void operator()(const NodeStmtFunction* stmt_function) const {
+				gen->gen_function(stmt_function);
 			}
 			void operator()(const NodeStmtFunctionCall* stmt_function_call) const {
-				const auto it = std::ranges::find_if(gen->m_functions, [&](const Func& func) {
-					return func.name == stmt_function_call->ident.value.value();
-				});
-				if (it == gen->m_functions.end()) {
-					std::cerr << "Undeclared function identifier: " << stmt_function_call->ident.value.value() << std::endl;
+				gen->gen_call(stmt_function_call->ident, stmt_function_call->args);
+			}
+			void operator()(const NodeStmtReturn* stmt_return) const {
+				if (!gen->in_function()) {
+					std::cerr << "Return outside of a function" << std::endl;
 					exit(EXIT_FAILURE);
 				}
-
-				for(const auto & arg : stmt_function_call->args) {
-					gen->push(gen->gen_expr_to_str(arg), false);
-				}
-
-				gen->m_output << "\tcall " << it->label << "\n";
+				gen->gen_expr(stmt_return->expr);
+				gen->pop("rax");
+				gen->gen_return();
 			}
 		};
 
-		StmtVisitor visitor { this, is_function };
+		StmtVisitor visitor { this };
 		std::visit(visitor, stmt->var);
 	}
 
-	std::string gen_bin_expr_to_str(const NodeBinExpr* expr) {
-		std::stringstream ss;
-		struct BinExprVisitor {
-			Generator* gen;
-			std::stringstream& ss;
-			void operator()(const NodeBinExprAdd* bin_expr_add) const {
-				ss << std::to_string(std::stoi(gen->gen_expr_to_str(bin_expr_add->lhs)) + std::stoi(gen->gen_expr_to_str(bin_expr_add->rhs)));
-			}
-			void operator()(const NodeBinExprMinus* bin_expr_sub) const {
-				ss << std::to_string(std::stoi(gen->gen_expr_to_str(bin_expr_sub->lhs)) - std::stoi(gen->gen_expr_to_str(bin_expr_sub->rhs)));
+	// SysV-style calls: the first six arguments go in rdi, rsi, rdx, rcx, r8
+	// and r9, the rest on the stack with the seventh on top, and the result
+	// comes back in rax. The callee pushes its parameters and binds them as
+	// locals, so a function sees only its parameters and its own variables.
+	// Each function is generated into its own list first, so one declared
+	// inside another's body does not land in the middle of it.
+	void gen_function(const NodeStmtFunction* stmt_function) {
+		if (const Func* it = m_functions.find(stmt_function->ident.symbol)) {
+			std::cerr << "Already declared function identifier: " << it->name << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		const std::string name(stmt_function->ident.value.value());
+		const size_t index = m_func_counter++;
+		const Func func { name, name + "_" + std::to_string(index), stmt_function->args.size(), index };
+		m_functions.bind(stmt_function->ident.symbol, func);
+
+		// Nested declarations must be bound in program order, so only
+		// functions without them can wait for the pool.
+		if (m_jobs != 1 && !declares_functions(stmt_function->scope->stmts)) {
+			m_deferred.push_back(DeferredFunction { stmt_function, func });
+			return;
+		}
+		const InstrList body = gen_function_body(stmt_function, func.label);
+		m_function_defs.instrs().insert(m_function_defs.instrs().end(), body.instrs().begin(), body.instrs().end());
+	}
+
+	[[nodiscard]] InstrList gen_function_body(const NodeStmtFunction* stmt_function, const std::string& label) {
+		InstrList body;
+		InstrList* const outer_section = std::exchange(m_section, &body);
+		ScopedSymbolTable<Var> outer_vars = std::exchange(m_vars, {});
+		std::vector<SavedReg> outer_saved_regs = std::exchange(m_saved_regs, {});
+		const size_t outer_stack_size = std::exchange(m_stack_size, 0);
+		const size_t outer_loop_depth = std::exchange(m_loop_depth, 0);
+		const bool outer_is_exiting = m_is_exiting;
+
+		create_label(label);
+		const size_t num_params = stmt_function->args.size();
+		for (size_t i = 0; i < num_params; i++) {
+			const auto* param = std::get_if<NodeTermIdent*>(&stmt_function->args[i]->var);
+			if (param == nullptr) {
+				std::cerr << "Invalid parameter" << std::endl;
+				exit(EXIT_FAILURE);
 			}
-			void operator()(const NodeBinExprMulti* bin_expr_multi) const {
-				ss << std::to_string(std::stoi(gen->gen_expr_to_str(bin_expr_multi->lhs)) * std::stoi(gen->gen_expr_to_str(bin_expr_multi->rhs)));
+			if (m_vars.find((*param)->ident.symbol) != nullptr) {
+				std::cerr << "Identifier already used: " << (*param)->ident.value.value() << std::endl;
+				exit(EXIT_FAILURE);
 			}
-			void operator()(const NodeBinExprDiv* bin_expr_div) const {
-				ss << std::to_string(std::stoi(gen->gen_expr_to_str(bin_expr_div->lhs)) / std::stoi(gen->gen_expr_to_str(bin_expr_div->rhs)));
+			m_vars.bind((*param)->ident.symbol, Var { m_stack_size });
+			if (i < arg_regs.size()) {
+				push(std::string(arg_regs[i]));
+			} else {
+				// Above the return address and the parameters pushed so far.
+				push(stack_slot((m_stack_size + 1 + i - arg_regs.size()) * 8));
 			}
-		};
+		}
+		const std::pmr::vector<NodeStmt*>& stmts = stmt_function->scope->stmts;
+		for (const NodeStmt* stmt : stmts) {
+			gen_stmt(stmt);
+		}
+		// Falling off the end returns 0; a body ending in return never does.
+		if (stmts.empty() || !std::holds_alternative<NodeStmtReturn*>(stmts.back()->var)) {
+			body.emit("xor", "eax", "eax");
+			gen_return();
+		}
 
-		BinExprVisitor visitor { this, ss };
-		std::visit(visitor, expr->var);
-		return ss.str();
+		m_section = outer_section;
+		m_vars = std::move(outer_vars);
+		m_saved_regs = std::move(outer_saved_regs);
+		m_stack_size = outer_stack_size;
+		m_loop_depth = outer_loop_depth;
+		m_is_exiting = outer_is_exiting;
+		return body;
 	}
 
-	std::string gen_expr_to_str(const NodeExpr* expr) {
-		std::stringstream ss;
-		struct ExprVisitor {
-			Generator* gen;
-			std::stringstream& ss;
-			void operator()(const NodeTerm* term) const {
-				ss << gen->gen_term_to_str(term);
+	// Restores the loop registers saved so far in this function, drops its
+	// frame and returns; the value is already in rax. Generation carries on
+	// after it with the same stack layout, so a return can sit anywhere.
+	void gen_return() {
+		for (auto it = m_saved_regs.rbegin(); it != m_saved_regs.rend(); ++it) {
+			section().emit("mov", it->reg, stack_slot((m_stack_size - it->stack_loc - 1) * 8));
+		}
+		if (m_stack_size > 0) {
+			section().emit("add", "rsp", std::to_string(m_stack_size * 8));
+		}
+		section().emit("ret");
+	}
+
+	// Leaves the result in rax. Arguments are evaluated left to right.
+	void gen_call(const Token& ident, const std::pmr::vector<NodeExpr*>& args) {
+		const Func* func = find_function(ident.symbol);
+		if (func == nullptr) {
+			std::cerr << "Undeclared function identifier: " << ident.value.value() << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		if (args.size() != func->num_params) {
+			std::cerr << "Wrong number of arguments to " << ident.value.value() << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		InstrList& out = section();
+		for (const NodeExpr* arg : args) {
+			gen_expr(arg);
+		}
+		const size_t n = args.size();
+		if (n <= arg_regs.size()) {
+			for (size_t i = n; i-- > 0;) {
+				pop(std::string(arg_regs[i]));
 			}
-			void operator()(const NodeBinExpr* bin_expr) const {
-				ss << gen->gen_bin_expr_to_str(bin_expr);
+			out.emit("call", func->label);
+			return;
+		}
+		for (size_t i = 0; i < arg_regs.size(); i++) {
+			out.emit("mov", std::string(arg_regs[i]), stack_slot((n - 1 - i) * 8));
+		}
+		// The stack arguments were pushed last one on top; reverse them.
+		for (size_t lo = 0, hi = n - 1 - arg_regs.size(); lo < hi; lo++, hi--) {
+			out.emit("mov", "rax", stack_slot(lo * 8));
+			out.emit("mov", "r11", stack_slot(hi * 8));
+			out.emit("mov", stack_slot(lo * 8), "r11");
+			out.emit("mov", stack_slot(hi * 8), "rax");
+		}
+		out.emit("call", func->label);
+		out.emit("add", "rsp", std::to_string(n * 8));
+		m_stack_size -= n;
+	}
+
+	// The trip count is to - from, evaluated once before the loop. The
+	// counter lives in a callee-saved register, one per nesting level, so
+	// neither the body's expressions nor calls clobber it; inside functions
+	// and below the last register level the register is saved around the
+	// whole loop. The loop is rotated so each iteration ends in a single
+	// dec/jnz, with the zero test done once up front when the count is not
+	// known. Constant trip counts up to unroll_limit are unrolled instead.
+	void gen_for(const NodeStmtFor* stmt_for) {
+		InstrList& out = section();
+		const std::optional<int64_t> from = const_value(stmt_for->from);
+		const std::optional<int64_t> to = const_value(stmt_for->to);
+		std::optional<int64_t> trip_count;
+		if (from.has_value() && to.has_value()) {
+			trip_count = *to - *from;
+		}
+		if (trip_count.has_value() && *trip_count > 0 && static_cast<uint64_t>(*trip_count) <= m_unroll_limit) {
+			for (int64_t i = 0; i < *trip_count; i++) {
+				gen_loop_body(stmt_for);
 			}
-		};
-		ExprVisitor visitor { this, ss };
-		std::visit(visitor, expr->var);
-		return ss.str();
+			return;
+		}
+
+		const std::string reg(loop_regs[m_loop_depth % loop_regs.size()]);
+		const bool save_reg = in_function() || m_loop_depth >= loop_regs.size();
+		if (save_reg) {
+			m_saved_regs.push_back(SavedReg { reg, m_stack_size });
+			push(reg);
+		}
+		if (trip_count.has_value()) {
+			out.emit("mov", reg, std::to_string(*trip_count));
+		} else {
+			gen_expr(stmt_for->to);
+			gen_expr(stmt_for->from);
+			pop("rax");
+			pop(reg);
+			out.emit("sub", reg, "rax");
+		}
+
+		const std::string id = std::to_string(++m_for_counter);
+		const std::string loop = m_label_prefix + "loop_" + id;
+		const std::string end_loop = m_label_prefix + "endloop_" + id;
+		if (!trip_count.has_value() || *trip_count == 0) {
+			out.emit("test", reg, reg);
+			out.emit("jz", end_loop);
+		}
+		create_label(loop);
+		m_loop_depth++;
+		gen_loop_body(stmt_for);
+		m_loop_depth--;
+		out.emit("dec", reg);
+		out.emit("jnz", loop);
+		create_label(end_loop);
+		if (save_reg) {
+			pop(reg);
+			m_saved_regs.pop_back();
+		}
 	}
 
-	std::string gen_term_to_str(const NodeTerm* term) {
-		std::stringstream ss;
-		struct TermVisitor {
-			Generator* gen;
-			std::stringstream& ss;
-			void operator()(const NodeTermIntLit* term_int_lit) const {
-				ss << term_int_lit->int_lit.value.value();
+	// Each iteration is its own scope, so the body's locals are popped
+	// before the next one instead of piling up on the stack.
+	void gen_loop_body(const NodeStmtFor* stmt_for) {
+		begin_scope();
+		for (const NodeStmt* stmt : stmt_for->scope->stmts) {
+			gen_stmt(stmt);
+		}
+		end_scope();
+	}
+
+	// Postfix order is exactly the order the stack machine evaluates in, so
+	// the whole expression is emitted by one pass over its node range.
+	void gen_flat_expr(const FlatExpr& expr) {
+		InstrList& out = section();
+		for (const FlatExprNode& node : m_flat->nodes(expr)) {
+			switch (node.op) {
+			case FlatOp::int_lit:
+				out.emit("mov", "rax", std::string(m_flat->value(node)));
+				push("rax");
+				break;
+			case FlatOp::ident:
+				push_var(node.rhs, m_flat->value(node));
+				break;
+			case FlatOp::add:
+			case FlatOp::sub:
+			case FlatOp::mul:
+			case FlatOp::div:
+				pop("rbx");
+				pop("rax");
+				emit_flat_op(node.op, out);
+				push("rax");
+				break;
+			case FlatOp::call: {
+				const NodeTermCall* call = m_flat->call(node);
+				gen_call(call->ident, call->args);
+				push("rax");
+				break;
 			}
-			void operator()(const NodeTermIdent* term_ident) const {
-				auto it = std::find_if(gen->m_vars.cbegin(), gen->m_vars.cend(), [&](const Var& var) {
-						return var.name == term_ident->ident.value.value();
-				});
-				if (it != gen->m_vars.cend()) {
-					ss << (*it).value;
-				} else {
-					ss << term_ident->ident.value.value();
-				}
 			}
-			void operator()(const NodeTermParen* term_paren) const {
-				ss << gen->gen_expr_to_str(term_paren->expr);
+		}
+	}
+
+	// Sethi-Ullman evaluation: every node is labelled with the number of
+	// registers it needs (operands precede their parent in postfix order, so
+	// one forward pass does it), and the hungrier operand is evaluated first
+	// so the other one fits in the registers that are left. The result is
+	// pushed, like the stack machine does, so statements are unaffected.
+	void gen_reg_expr(const FlatExpr& expr) {
+		const std::span<const FlatExprNode> nodes = m_flat->nodes(expr);
+		m_reg_need.resize(nodes.size());
+		for (size_t i = 0; i < nodes.size(); i++) {
+			const FlatExprNode& node = nodes[i];
+			if (node.op == FlatOp::int_lit || node.op == FlatOp::ident) {
+				m_reg_need[i] = { 1, false };
+			} else if (node.op == FlatOp::call) {
+				// Live registers are saved around a call, so calls go first
+				// when the order is free.
+				m_reg_need[i] = { static_cast<uint32_t>(reg_pool.size()), true };
+			} else {
+				const RegNeed lhs = m_reg_need[node.lhs - expr.begin];
+				const RegNeed rhs = m_reg_need[node.rhs - expr.begin];
+				m_reg_need[i] = { lhs.regs == rhs.regs ? lhs.regs + 1 : std::max(lhs.regs, rhs.regs), lhs.calls || rhs.calls };
 			}
-		};
-		TermVisitor visitor { this, ss };
-		std::visit(visitor, term->var);
-		return ss.str();
+		}
+		gen_reg_node(expr, expr.end - 1, 0);
+		push(std::string(reg_pool[0]));
 	}
 
-	[[nodiscard]] std::string gen_prog() {
-		m_output << "global _start\n";
+	[[nodiscard]] AsmBuffer gen_prog() {
 		create_label("_start");
 
 		for (const NodeStmt* stmt : m_prog.stmts) {
-			gen_stmt(stmt, false);
+			gen_stmt(stmt);
 		}
 
 		if (!m_is_exiting) {
-			m_output << "\tmov rax, 60\n";
-			m_output << "\tmov rdi, 0\n";
-			m_output << "\tsyscall\n";
+			m_output.emit("mov", "rdi", "0");
+			m_output.emit("call", "mine_exit");
 		}
+		gen_deferred_functions();
+
+		m_peephole.run(m_output.instrs());
+		m_peephole.run(m_function_defs.instrs());
+
+		AsmBuffer out;
+		out.append("global _start\n");
+		m_output.render(out);
 
 		if (m_func_counter > 0) {
-			m_output << "\n";
-			m_output << m_functions_output.str();
+			out.append('\n');
+			m_function_defs.render(out);
 		}
 
-		if (m_data.str().size() > 0) {
-			m_output << "\n";
-			m_output << "section .data\n";
-			m_output << m_data.str();
-		}
+		out.append(runtime_asm);
+		return out;
+	}
 
-		return m_output.str();
+	[[nodiscard]] const Peephole& peephole() const {
+		return m_peephole;
 	}
 
 private:
-	void push(const std::string& reg, const bool is_function = false) {
-		if (is_function) {
-			m_functions_output << "\tpush " << reg << "\n";
-		} else {
-			m_output << "\tpush " << reg << "\n";
+	struct Func;
+
+	// Generates the body of one deferred function for `parent`. It sees the
+	// parent's expression tables and the functions declared up to its own
+	// declaration, and keeps its own counters behind a label prefix.
+	Generator(const Generator& parent, const Func& func)
+		: m_reg_exprs(parent.m_reg_exprs)
+		, m_unroll_limit(parent.m_unroll_limit)
+		, m_strength_reduce(parent.m_strength_reduce)
+		, m_jobs(1)
+		, m_flat(parent.m_flat)
+		, m_label_prefix(func.label + "_")
+		, m_parent(&parent)
+		, m_visible_functions(func.index)
+	{
+	}
+
+	// Bodies are concatenated in declaration order whichever thread
+	// generated them.
+	void gen_deferred_functions() {
+		std::vector<InstrList> bodies(m_deferred.size());
+		WorkStealingPool::run(m_deferred.size(), m_jobs, [&](const size_t i) {
+			const DeferredFunction& deferred = m_deferred[i];
+			Generator worker(*this, deferred.func);
+			bodies[i] = worker.gen_function_body(deferred.stmt, deferred.func.label);
+		});
+		for (const InstrList& body : bodies) {
+			m_function_defs.instrs().insert(m_function_defs.instrs().end(), body.instrs().begin(), body.instrs().end());
 		}
-		m_stack_size++;
 	}
 
-	void pop(const std::string& reg, const bool is_function = false) {
-		if (is_function) {
-			m_functions_output << "\tpop " << reg << "\n";
-		} else {
-			m_output << "\tpop " << reg << "\n";
+	[[nodiscard]] const Func* find_function(const SymbolId symbol) const {
+		if (m_parent != nullptr) {
+			const Func* func = m_parent->m_functions.find(symbol);
+			return func != nullptr && func->index <= m_visible_functions ? func : nullptr;
 		}
-		m_stack_size--;
+		return m_functions.find(symbol);
 	}
 
-	void begin_scope() {
-		m_scopes.push_back(m_vars.size());
+	[[nodiscard]] static bool declares_functions(const std::pmr::vector<NodeStmt*>& stmts) {
+		for (const NodeStmt* stmt : stmts) {
+			if (std::holds_alternative<NodeStmtFunction*>(stmt->var)) {
+				return true;
+			}
+			const NodeScope* scope = nullptr;
+			if (const auto* stmt_scope = std::get_if<NodeScope*>(&stmt->var)) {
+				scope = *stmt_scope;
+			} else if (const auto* stmt_if = std::get_if<NodeStmtIf*>(&stmt->var)) {
+				scope = (*stmt_if)->scope;
+			} else if (const auto* stmt_for = std::get_if<NodeStmtFor*>(&stmt->var)) {
+				scope = (*stmt_for)->scope;
+			}
+			if (scope != nullptr && declares_functions(scope->stmts)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	[[nodiscard]] static std::optional<int64_t> const_value(const NodeExpr* expr) {
+		const Token* int_lit = as_int_lit(expr);
+		return int_lit != nullptr ? parse_int_lit(int_lit->value.value()) : std::nullopt;
 	}
 
-	void end_scope(const bool is_function = false) {
-		size_t pop_count = m_vars.size() - m_scopes.back();
-		if (is_function) {
-			m_functions_output << "\tadd rsp, " << pop_count * 8 << "\n";
+	// Loop counters by nesting depth. Callee-saved in the SysV ABI and never
+	// touched by expression code.
+	static constexpr std::array<std::string_view, 4> loop_regs { "r12", "r13", "r14", "r15" };
+
+	static constexpr std::array<std::string_view, 6> arg_regs { "rdi", "rsi", "rdx", "rcx", "r8", "r9" };
+
+	// Scratch registers for expression evaluation, in allocation order. rax
+	// and rdx are kept out for div.
+	static constexpr std::array<std::string_view, 7> reg_pool { "rbx", "rcx", "rsi", "rdi", "r9", "r10", "r11" };
+
+	// Evaluates node `index` into reg_pool[k], using only reg_pool[k..]. With
+	// a single register left, the first operand is spilled to the stack and
+	// reloaded into rax for the combining instruction.
+	void gen_reg_node(const FlatExpr& expr, const uint32_t index, const size_t k) {
+		InstrList& out = section();
+		const FlatExprNode& node = m_flat->nodes(expr)[index - expr.begin];
+		const std::string_view dst = reg_pool[k];
+		switch (node.op) {
+		case FlatOp::int_lit:
+			out.emit("mov", std::string(dst), std::string(m_flat->value(node)));
+			return;
+		case FlatOp::ident:
+			out.emit("mov", std::string(dst), var_operand(node.rhs, m_flat->value(node)));
+			return;
+		case FlatOp::call: {
+			// Every pool register is caller-saved, so the ones that may
+			// hold a partial result are kept on the stack over the call.
+			for (size_t i = 0; i < k; i++) {
+				push(std::string(reg_pool[i]));
+			}
+			std::vector<RegNeed> need = std::move(m_reg_need);
+			const NodeTermCall* call = m_flat->call(node);
+			gen_call(call->ident, call->args);
+			m_reg_need = std::move(need);
+			out.emit("mov", std::string(dst), "rax");
+			for (size_t i = k; i-- > 0;) {
+				pop(std::string(reg_pool[i]));
+			}
+			return;
+		}
+		default:
+			break;
+		}
+		if (m_strength_reduce && gen_reg_const_op(expr, node, k)) {
+			return;
+		}
+
+		// Calls have side effects, so one on the right keeps the operands
+		// in source order.
+		const RegNeed lhs_need = m_reg_need[node.lhs - expr.begin];
+		const RegNeed rhs_need = m_reg_need[node.rhs - expr.begin];
+		const bool lhs_first = lhs_need.regs >= rhs_need.regs || rhs_need.calls;
+		gen_reg_node(expr, lhs_first ? node.lhs : node.rhs, k);
+		std::string_view first_reg = dst;
+		std::string_view second_reg;
+		if (k + 1 < reg_pool.size()) {
+			gen_reg_node(expr, lhs_first ? node.rhs : node.lhs, k + 1);
+			second_reg = reg_pool[k + 1];
 		} else {
-			m_output << "\tadd rsp, " << pop_count * 8 << "\n";
+			push(std::string(dst));
+			gen_reg_node(expr, lhs_first ? node.rhs : node.lhs, k);
+			pop("rax");
+			first_reg = "rax";
+			second_reg = dst;
 		}
-		m_stack_size -= pop_count;
-		for (int i = 0; i < pop_count; i++) {
-			m_vars.pop_back();
+		const std::string_view lhs = lhs_first ? first_reg : second_reg;
+		const std::string_view rhs = lhs_first ? second_reg : first_reg;
+		gen_reg_op(node.op, dst, lhs, rhs, out);
+	}
+
+	// x op c with a literal c (on either side of + and *): only x takes a
+	// register and c goes into the instruction stream. Division by a literal
+	// 0 is left to the div instruction so it still traps.
+	bool gen_reg_const_op(const FlatExpr& expr, const FlatExprNode& node, const size_t k) {
+		const auto literal = [&](const uint32_t index) -> std::optional<int64_t> {
+			const FlatExprNode& operand = m_flat->nodes(expr)[index - expr.begin];
+			if (operand.op != FlatOp::int_lit) {
+				return std::nullopt;
+			}
+			return parse_int_lit(m_flat->value(operand));
+		};
+		uint32_t other = node.lhs;
+		std::optional<int64_t> c = literal(node.rhs);
+		if (!c.has_value() && (node.op == FlatOp::add || node.op == FlatOp::mul)) {
+			other = node.rhs;
+			c = literal(node.lhs);
 		}
-		m_scopes.pop_back();
+		if (!c.has_value() || (node.op == FlatOp::div && *c == 0)) {
+			return false;
+		}
+		if ((node.op == FlatOp::add || node.op == FlatOp::sub) && (*c < INT32_MIN || *c > INT32_MAX)) {
+			return false;
+		}
+
+		InstrList& out = section();
+		const std::string dst(reg_pool[k]);
+		gen_reg_node(expr, other, k);
+		switch (node.op) {
+		case FlatOp::add:
+			out.emit("add", dst, std::to_string(*c));
+			break;
+		case FlatOp::sub:
+			out.emit("sub", dst, std::to_string(*c));
+			break;
+		case FlatOp::mul:
+			emit_mul_const(out, dst, *c);
+			break;
+		case FlatOp::div:
+			emit_div_const(out, dst, static_cast<uint64_t>(*c));
+			break;
+		default:
+			assert(false);
+		}
+		return true;
 	}
 
-	void create_label(const std::string& label, const bool is_function = false) {
-		if (is_function) {
-			m_functions_output << label << ":\n";
-		} else {
-			m_output << label << ":\n";
+	// Combines lhs and rhs into dst, which is one of the two.
+	static void gen_reg_op(const FlatOp op, const std::string_view dst, const std::string_view lhs, const std::string_view rhs, InstrList& out) {
+		const std::string_view other = dst == lhs ? rhs : lhs;
+		switch (op) {
+		case FlatOp::add:
+			out.emit("add", std::string(dst), std::string(other));
+			break;
+		case FlatOp::mul:
+			out.emit("imul", std::string(dst), std::string(other));
+			break;
+		case FlatOp::sub:
+			if (dst == lhs) {
+				out.emit("sub", std::string(dst), std::string(rhs));
+			} else {
+				out.emit("neg", std::string(dst));
+				out.emit("add", std::string(dst), std::string(lhs));
+			}
+			break;
+		case FlatOp::div:
+			if (rhs == "rax") {
+				out.emit("xchg", "rax", std::string(dst));
+			} else if (lhs != "rax") {
+				out.emit("mov", "rax", std::string(lhs));
+			}
+			out.emit("xor", "edx", "edx");
+			out.emit("div", std::string(rhs == "rax" ? dst : rhs));
+			out.emit("mov", std::string(dst), "rax");
+			break;
+		default:
+			assert(false);
+		}
+	}
+
+	static void emit_flat_op(const FlatOp op, InstrList& out) {
+		switch (op) {
+		case FlatOp::add:
+			out.emit("add", "rax", "rbx");
+			break;
+		case FlatOp::sub:
+			out.emit("sub", "rax", "rbx");
+			break;
+		case FlatOp::mul:
+			out.emit("mul", "rbx");
+			break;
+		case FlatOp::div:
+			out.emit("xor", "edx", "edx");
+			out.emit("div", "rbx");
+			break;
+		default:
+			assert(false);
 		}
 	}
 
+	// Where code is emitted: the body of the function being generated, or
+	// the top-level program.
+	[[nodiscard]] InstrList& section() {
+		return m_section != nullptr ? *m_section : m_output;
+	}
+
+	[[nodiscard]] bool in_function() const {
+		return m_section != nullptr;
+	}
+
+	void push_var(const SymbolId symbol, const std::string_view name) {
+		push(var_operand(symbol, name));
+	}
+
+	[[nodiscard]] std::string var_operand(const SymbolId symbol, const std::string_view name) const {
+		const Var* var = m_vars.find(symbol);
+		if (var == nullptr) {
+			std::cerr << "Undeclared identifier: " << name << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		return stack_slot((m_stack_size - var->stack_loc - 1) * 8);
+	}
+
+	void push(const std::string& reg) {
+		section().emit("push", reg);
+		m_stack_size++;
+	}
+
+	void pop(const std::string& reg) {
+		section().emit("pop", reg);
+		m_stack_size--;
+	}
+
+	void begin_scope() {
+		m_vars.begin_scope();
+	}
+
+	void end_scope() {
+		const size_t pop_count = m_vars.end_scope();
+		section().emit("add", "rsp", std::to_string(pop_count * 8));
+		m_stack_size -= pop_count;
+	}
+
+	void create_label(const std::string& label) {
+		section().label(label);
+	}
+
 	struct Var {
 		size_t stack_loc;
-		std::string name;
-		std::string value;
 	};
 
 	struct Func {
 		std::string name;
 		std::string label;
-		std::vector<std::string> params;
+		size_t num_params;
+		// Declaration order, also the number in the label.
+		size_t index;
+	};
+
+	struct DeferredFunction {
+		const NodeStmtFunction* stmt;
+		Func func;
+	};
+
+	// Sethi-Ullman label of an expression node, and whether it contains a
+	// call.
+	struct RegNeed {
+		uint32_t regs;
+		bool calls;
+	};
+
+	// A loop register pushed at stack_loc, restored by an early return.
+	struct SavedReg {
+		std::string reg;
+		size_t stack_loc;
 	};
 
 	const NodeProg m_prog;
-	std::stringstream m_output;
+	const bool m_reg_exprs;
+	const size_t m_unroll_limit;
+	const bool m_strength_reduce;
+	const size_t m_jobs;
+	size_t m_loop_depth = 0;
+	std::shared_ptr<const FlatAst> m_flat {};
+	std::vector<RegNeed> m_reg_need {};
+	Peephole m_peephole;
+	InstrList m_output;
 	size_t m_stack_size = 0;
-	std::vector<Var> m_vars {};
-	size_t m_data_counter = 0;
+	ScopedSymbolTable<Var> m_vars {};
 	size_t m_for_counter = 0;
 	size_t m_if_counter = 0;
 	size_t m_func_counter = 0;
 	bool m_is_exiting = false;
-	std::stringstream m_data;
-	std::vector<size_t> m_scopes {};
-	std::stringstream m_functions_output;
-	std::vector<Func> m_functions {};
+	// Body of the function being generated, null at top level; finished
+	// functions move to m_function_defs.
+	InstrList* m_section = nullptr;
+	InstrList m_function_defs;
+	std::vector<SavedReg> m_saved_regs {};
+	ScopedSymbolTable<Func> m_functions {};
+	std::vector<DeferredFunction> m_deferred {};
+	// Prefix of if and loop labels. At top level the leading '_' keeps them
+	// apart from function labels, which start with an identifier; a deferred
+	// function's body uses its function's label instead.
+	const std::string m_label_prefix = "_";
+	// Set for a deferred function's body: the Generator whose functions it
+	// may call.
+	const Generator* m_parent = nullptr;
+	size_t m_visible_functions = 0;
 };
\ No newline at end of file
@@ -0,0 +1,452 @@
+#pragma once
+
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+#include "./arena.hpp"
+#include "./parser.hpp"
+#include "./symbols.hpp"
+
+struct InlineOptions {
+	// Largest body, in expression nodes after argument substitution, that
+	// is cloned into a call site; 0 disables inlining.
+	size_t max_cost = 24;
+	// How many inlined bodies may nest, which also bounds how far a
+	// recursive function is unrolled into its callers.
+	size_t max_depth = 3;
+};
+
+// Replaces calls to small functions with a copy of the function's body, so
+// ConstantFolder and the code generators see through them. Runs on the
+// tree before folding, in program order, so a function's own calls are
+// already inlined when it becomes a candidate.
+//
+// A function is a candidate when its body is some `let`s followed by a
+// single `return`: the lets are substituted into the returned expression,
+// which becomes a template over the parameters. A call term is replaced by
+// a clone of the template with each parameter replaced by a clone of its
+// argument. Arguments must not contain calls, since substituting them
+// would move or repeat their side effects; an argument that is not a
+// literal or variable adds its size to the cost for every extra use of
+// its parameter. A statement call is removed when the template and the
+// arguments have no effects at all. The functions themselves are still
+// emitted for the calls that stay.
+class Inliner {
+public:
+	explicit Inliner(ArenaAllocator& allocator, const InlineOptions options = {})
+		: m_allocator(allocator)
+		, m_options(options)
+	{
+	}
+
+	void run(NodeProg& prog) {
+		if (m_options.max_cost > 0) {
+			inline_stmts(prog.stmts, 0);
+		}
+	}
+
+	[[nodiscard]] size_t num_inlined() const {
+		size_t count = 0;
+		for (const FunctionReport& function : m_reports) {
+			count += function.inlined;
+		}
+		return count;
+	}
+
+	void report(std::ostream& out) const {
+		for (const FunctionReport& function : m_reports) {
+			out << std::left << std::setw(16) << function.name << std::right;
+			if (!function.reason.empty()) {
+				out << "  not inlined: " << function.reason << std::endl;
+				continue;
+			}
+			out << "  cost " << std::setw(3) << function.cost << "  inlined " << std::setw(4) << function.inlined
+				<< "  kept " << std::setw(4) << function.kept << std::endl;
+		}
+		out << "inlined " << num_inlined() << " call sites" << std::endl;
+	}
+
+private:
+	struct Candidate {
+		std::vector<SymbolId> params;
+		// Null when the function cannot be inlined.
+		const NodeExpr* body;
+		size_t report;
+	};
+
+	struct FunctionReport {
+		std::string name {};
+		std::string reason {};
+		size_t cost = 0;
+		size_t inlined = 0;
+		size_t kept = 0;
+	};
+
+	void inline_stmts(const std::pmr::vector<NodeStmt*>& stmts, const size_t depth) {
+		for (NodeStmt* stmt : stmts) {
+			inline_stmt(stmt, depth);
+		}
+	}
+
+	void inline_stmt(NodeStmt* stmt, const size_t depth) {
+		struct StmtVisitor {
+			Inliner* inliner;
+			NodeStmt* stmt;
+			size_t depth;
+			void operator()(NodeStmtExit* stmt_exit) const {
+				inliner->inline_expr(stmt_exit->expr, depth);
+			}
+			void operator()(NodeStmtLet* stmt_let) const {
+				inliner->inline_expr(stmt_let->expr, depth);
+			}
+			void operator()(NodeStmtPrint* stmt_print) const {
+				inliner->inline_expr(stmt_print->expr, depth);
+			}
+			void operator()(NodeScope* scope) const {
+				inliner->inline_stmts(scope->stmts, depth);
+			}
+			void operator()(NodeStmtIf* stmt_if) const {
+				inliner->inline_expr(stmt_if->cond, depth);
+				inliner->inline_stmts(stmt_if->scope->stmts, depth);
+			}
+			void operator()(NodeStmtFor* stmt_for) const {
+				inliner->inline_expr(stmt_for->from, depth);
+				inliner->inline_expr(stmt_for->to, depth);
+				inliner->inline_stmts(stmt_for->scope->stmts, depth);
+			}
+			void operator()(NodeStmtAssign* stmt_assign) const {
+				inliner->inline_expr(stmt_assign->expr, depth);
+			}
+			void operator()(NodeStmtFunction* stmt_function) const {
+				inliner->inline_stmts(stmt_function->scope->stmts, depth);
+				inliner->add_candidate(stmt_function);
+			}
+			void operator()(NodeStmtFunctionCall* stmt_call) const {
+				for (NodeExpr* arg : stmt_call->args) {
+					inliner->inline_expr(arg, depth);
+				}
+				if (inliner->expand(stmt_call->ident, stmt_call->args, depth, true) != nullptr) {
+					stmt->var = inliner->m_allocator.emplace<NodeScope>(std::pmr::vector<NodeStmt*>(stmt_call->args.get_allocator()));
+				}
+			}
+			void operator()(NodeStmtReturn* stmt_return) const {
+				inliner->inline_expr(stmt_return->expr, depth);
+			}
+		};
+		std::visit(StmtVisitor { this, stmt, depth }, stmt->var);
+	}
+
+	void inline_expr(NodeExpr* expr, const size_t depth) {
+		if (auto* term = std::get_if<NodeTerm*>(&expr->var)) {
+			inline_term(*term, depth);
+			return;
+		}
+		const auto [lhs, rhs] = operands(std::get<NodeBinExpr*>(expr->var));
+		inline_expr(lhs, depth);
+		inline_expr(rhs, depth);
+	}
+
+	void inline_term(NodeTerm* term, const size_t depth) {
+		if (auto* paren = std::get_if<NodeTermParen*>(&term->var)) {
+			inline_expr((*paren)->expr, depth);
+			return;
+		}
+		auto* call = std::get_if<NodeTermCall*>(&term->var);
+		if (call == nullptr) {
+			return;
+		}
+		for (NodeExpr* arg : (*call)->args) {
+			inline_expr(arg, depth);
+		}
+		if (NodeExpr* body = expand((*call)->ident, (*call)->args, depth, false)) {
+			// The copy may call further candidates, one level deeper.
+			inline_expr(body, depth + 1);
+			term->var = m_allocator.emplace<NodeTermParen>(body);
+		}
+	}
+
+	// Returns a fresh copy of the callee's template for these arguments, or
+	// null when the call stays. A statement call only needs the copy to
+	// check it for effects.
+	NodeExpr* expand(const Token& ident, const std::pmr::vector<NodeExpr*>& args, const size_t depth, const bool statement) {
+		const auto it = m_candidates.find(ident.symbol);
+		if (it == m_candidates.end()) {
+			return nullptr;
+		}
+		const Candidate& candidate = it->second;
+		FunctionReport& report = m_reports[candidate.report];
+		if (candidate.body == nullptr) {
+			return nullptr;
+		}
+		if (depth >= m_options.max_depth || args.size() != candidate.params.size()) {
+			report.kept++;
+			return nullptr;
+		}
+
+		// A call statement can only be dropped when nothing in it has an
+		// effect; a call inside the body must still see its arguments'
+		// traps happen first.
+		if (statement && has_effects(candidate.body)) {
+			report.kept++;
+			return nullptr;
+		}
+		size_t cost = report.cost;
+		for (size_t i = 0; i < args.size(); i++) {
+			const size_t uses = count_uses(candidate.body, candidate.params[i]);
+			const bool arg_effects = has_effects(args[i]);
+			if (has_call(args[i]) || (arg_effects && (uses == 0 || statement || has_call(candidate.body)))) {
+				report.kept++;
+				return nullptr;
+			}
+			if (uses > 1 && !is_leaf(args[i])) {
+				cost += (uses - 1) * size(args[i]);
+			}
+		}
+		if (cost > m_options.max_cost) {
+			report.kept++;
+			return nullptr;
+		}
+
+		std::unordered_map<SymbolId, const NodeExpr*> substitutions;
+		for (size_t i = 0; i < args.size(); i++) {
+			substitutions.emplace(candidate.params[i], args[i]);
+		}
+		report.inlined++;
+		return clone(candidate.body, substitutions);
+	}
+
+	void add_candidate(const NodeStmtFunction* stmt_function) {
+		m_reports.push_back(FunctionReport { .name = std::string(stmt_function->ident.value.value()) });
+		Candidate candidate { {}, nullptr, m_reports.size() - 1 };
+		FunctionReport& report = m_reports.back();
+
+		for (const NodeTerm* arg : stmt_function->args) {
+			const auto* param = std::get_if<NodeTermIdent*>(&arg->var);
+			if (param == nullptr) {
+				report.reason = "invalid parameter";
+				m_candidates.insert_or_assign(stmt_function->ident.symbol, candidate);
+				return;
+			}
+			candidate.params.push_back((*param)->ident.symbol);
+		}
+		candidate.body = make_template(stmt_function, candidate.params, report.reason);
+		if (candidate.body != nullptr) {
+			report.cost = size(candidate.body);
+			if (report.cost > m_options.max_cost) {
+				report.reason = "cost " + std::to_string(report.cost) + " over threshold";
+				candidate.body = nullptr;
+			}
+		}
+		m_candidates.insert_or_assign(stmt_function->ident.symbol, candidate);
+	}
+
+	// Substitutes the body's lets into its return expression. Anything
+	// else in the body, a let whose value calls a function, or a name that
+	// is neither a parameter nor a let keeps the function out of line.
+	const NodeExpr* make_template(const NodeStmtFunction* stmt_function, const std::vector<SymbolId>& params, std::string& reason) {
+		const std::pmr::vector<NodeStmt*>& stmts = stmt_function->scope->stmts;
+		if (stmts.empty() || !std::holds_alternative<NodeStmtReturn*>(stmts.back()->var)) {
+			reason = "does not end in a return";
+			return nullptr;
+		}
+		std::unordered_map<SymbolId, const NodeExpr*> lets;
+		for (const SymbolId param : params) {
+			lets.emplace(param, nullptr);
+		}
+		for (size_t i = 0; i + 1 < stmts.size(); i++) {
+			const auto* stmt_let = std::get_if<NodeStmtLet*>(&stmts[i]->var);
+			if (stmt_let == nullptr) {
+				reason = "body is not only lets and a return";
+				return nullptr;
+			}
+			if (has_call((*stmt_let)->expr) || !names_known((*stmt_let)->expr, lets)) {
+				reason = "let calls a function or uses an unknown name";
+				return nullptr;
+			}
+			if (lets.contains((*stmt_let)->ident.symbol)) {
+				reason = "redeclares a name";
+				return nullptr;
+			}
+			lets.emplace((*stmt_let)->ident.symbol, substitute_lets((*stmt_let)->expr, lets));
+		}
+		const NodeExpr* ret = std::get<NodeStmtReturn*>(stmts.back()->var)->expr;
+		if (!names_known(ret, lets)) {
+			reason = "uses an unknown name";
+			return nullptr;
+		}
+		// An unused let that may trap would lose its trap.
+		for (const auto& [symbol, value] : lets) {
+			if (value != nullptr && has_effects(value) && count_uses(ret, symbol) == 0) {
+				reason = "unused let may trap";
+				return nullptr;
+			}
+		}
+		return substitute_lets(ret, lets);
+	}
+
+	NodeExpr* substitute_lets(const NodeExpr* expr, const std::unordered_map<SymbolId, const NodeExpr*>& lets) {
+		std::unordered_map<SymbolId, const NodeExpr*> substitutions;
+		for (const auto& [symbol, value] : lets) {
+			if (value != nullptr) {
+				substitutions.emplace(symbol, value);
+			}
+		}
+		return clone(expr, substitutions);
+	}
+
+	// Deep copy of `expr`, with identifiers in `substitutions` replaced by
+	// copies of their expressions. The folder rewrites nodes in place, so
+	// no two call sites may share one.
+	NodeExpr* clone(const NodeExpr* expr, const std::unordered_map<SymbolId, const NodeExpr*>& substitutions) {
+		if (const auto* bin_expr = std::get_if<NodeBinExpr*>(&expr->var)) {
+			const auto [lhs, rhs] = operands(*bin_expr);
+			NodeExpr* const lhs_copy = clone(lhs, substitutions);
+			NodeExpr* const rhs_copy = clone(rhs, substitutions);
+			auto* copy = m_allocator.emplace<NodeBinExpr>();
+			std::visit([&](const auto* op) {
+				using Op = std::remove_const_t<std::remove_pointer_t<decltype(op)>>;
+				copy->var = m_allocator.emplace<Op>(lhs_copy, rhs_copy);
+			}, (*bin_expr)->var);
+			return m_allocator.emplace<NodeExpr>(copy);
+		}
+
+		struct TermVisitor {
+			Inliner* inliner;
+			const std::unordered_map<SymbolId, const NodeExpr*>& substitutions;
+			NodeTerm* operator()(const NodeTermIntLit* term_int_lit) const {
+				return inliner->m_allocator.emplace<NodeTerm>(inliner->m_allocator.emplace<NodeTermIntLit>(term_int_lit->int_lit));
+			}
+			NodeTerm* operator()(const NodeTermIdent* term_ident) const {
+				const auto it = substitutions.find(term_ident->ident.symbol);
+				if (it != substitutions.end()) {
+					auto* paren = inliner->m_allocator.emplace<NodeTermParen>(inliner->clone(it->second, {}));
+					return inliner->m_allocator.emplace<NodeTerm>(paren);
+				}
+				return inliner->m_allocator.emplace<NodeTerm>(inliner->m_allocator.emplace<NodeTermIdent>(term_ident->ident));
+			}
+			NodeTerm* operator()(const NodeTermParen* term_paren) const {
+				auto* paren = inliner->m_allocator.emplace<NodeTermParen>(inliner->clone(term_paren->expr, substitutions));
+				return inliner->m_allocator.emplace<NodeTerm>(paren);
+			}
+			NodeTerm* operator()(const NodeTermCall* term_call) const {
+				auto* call = inliner->m_allocator.emplace<NodeTermCall>(term_call->ident, std::pmr::vector<NodeExpr*>(term_call->args.get_allocator()));
+				for (const NodeExpr* arg : term_call->args) {
+					call->args.push_back(inliner->clone(arg, substitutions));
+				}
+				return inliner->m_allocator.emplace<NodeTerm>(call);
+			}
+		};
+		NodeTerm* term = std::visit(TermVisitor { this, substitutions }, std::get<NodeTerm*>(expr->var)->var);
+		return m_allocator.emplace<NodeExpr>(term);
+	}
+
+	[[nodiscard]] static std::pair<NodeExpr*, NodeExpr*> operands(const NodeBinExpr* bin_expr) {
+		return std::visit([](const auto* op) { return std::pair { op->lhs, op->rhs }; }, bin_expr->var);
+	}
+
+	// Calls `visit` on every term of `expr`, looking through parentheses
+	// but not into call arguments.
+	template <typename F>
+	static void for_each_term(const NodeExpr* expr, F&& visit) {
+		if (const auto* bin_expr = std::get_if<NodeBinExpr*>(&expr->var)) {
+			const auto [lhs, rhs] = operands(*bin_expr);
+			for_each_term(lhs, visit);
+			for_each_term(rhs, visit);
+			return;
+		}
+		const NodeTerm* term = std::get<NodeTerm*>(expr->var);
+		if (const auto* paren = std::get_if<NodeTermParen*>(&term->var)) {
+			for_each_term((*paren)->expr, visit);
+			return;
+		}
+		visit(term);
+		if (const auto* call = std::get_if<NodeTermCall*>(&term->var)) {
+			for (const NodeExpr* arg : (*call)->args) {
+				for_each_term(arg, visit);
+			}
+		}
+	}
+
+	[[nodiscard]] static size_t size(const NodeExpr* expr) {
+		if (const auto* bin_expr = std::get_if<NodeBinExpr*>(&expr->var)) {
+			const auto [lhs, rhs] = operands(*bin_expr);
+			return 1 + size(lhs) + size(rhs);
+		}
+		size_t count = 0;
+		for_each_term(expr, [&](const NodeTerm*) { count++; });
+		return count;
+	}
+
+	[[nodiscard]] static size_t count_uses(const NodeExpr* expr, const SymbolId symbol) {
+		size_t uses = 0;
+		for_each_term(expr, [&](const NodeTerm* term) {
+			const auto* ident = std::get_if<NodeTermIdent*>(&term->var);
+			uses += ident != nullptr && (*ident)->ident.symbol == symbol;
+		});
+		return uses;
+	}
+
+	[[nodiscard]] static bool has_call(const NodeExpr* expr) {
+		bool found = false;
+		for_each_term(expr, [&](const NodeTerm* term) {
+			found |= std::holds_alternative<NodeTermCall*>(term->var);
+		});
+		return found;
+	}
+
+	[[nodiscard]] static bool is_leaf(const NodeExpr* expr) {
+		const auto* term = std::get_if<NodeTerm*>(&expr->var);
+		return term != nullptr && !std::holds_alternative<NodeTermParen*>((*term)->var) && !std::holds_alternative<NodeTermCall*>((*term)->var);
+	}
+
+	[[nodiscard]] static bool names_known(const NodeExpr* expr, const std::unordered_map<SymbolId, const NodeExpr*>& names) {
+		bool known = true;
+		for_each_term(expr, [&](const NodeTerm* term) {
+			const auto* ident = std::get_if<NodeTermIdent*>(&term->var);
+			known &= ident == nullptr || names.contains((*ident)->ident.symbol);
+		});
+		return known;
+	}
+
+	// Calls, and divisions that might divide by zero.
+	[[nodiscard]] static bool has_effects(const NodeExpr* expr) {
+		if (const auto* bin_expr = std::get_if<NodeBinExpr*>(&expr->var)) {
+			const auto [lhs, rhs] = operands(*bin_expr);
+			if (const auto* div = std::get_if<NodeBinExprDiv*>(&(*bin_expr)->var)) {
+				const Token* divisor = as_literal((*div)->rhs);
+				if (divisor == nullptr || divisor->value.value().find_first_not_of('0') == std::string_view::npos) {
+					return true;
+				}
+			}
+			return has_effects(lhs) || has_effects(rhs);
+		}
+		const NodeTerm* term = std::get<NodeTerm*>(expr->var);
+		if (const auto* paren = std::get_if<NodeTermParen*>(&term->var)) {
+			return has_effects((*paren)->expr);
+		}
+		return std::holds_alternative<NodeTermCall*>(term->var);
+	}
+
+	[[nodiscard]] static const Token* as_literal(const NodeExpr* expr) {
+		const auto* term = std::get_if<NodeTerm*>(&expr->var);
+		if (term == nullptr) {
+			return nullptr;
+		}
+		if (const auto* paren = std::get_if<NodeTermParen*>(&(*term)->var)) {
+			return as_literal((*paren)->expr);
+		}
+		const auto* int_lit = std::get_if<NodeTermIntLit*>(&(*term)->var);
+		return int_lit == nullptr ? nullptr : &(*int_lit)->int_lit;
+	}
+
+	ArenaAllocator& m_allocator;
+	const InlineOptions m_options;
+	std::unordered_map<SymbolId, Candidate> m_candidates {};
+	std::vector<FunctionReport> m_reports {};
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "./emitter.hpp"
+
+// One line of generated assembly. Operands are kept as NASM text so the
+// generator can still spell them the way it always has, but each line is
+// split into mnemonic and operands so passes can match on them.
+struct Instr {
+	enum class Kind : uint8_t {
+		op,
+		label
+	};
+
+	Kind kind;
+	std::string mnemonic; // label name for Kind::label
+	std::string dst {};
+	std::string src {};
+
+	[[nodiscard]] bool is(const std::string_view m) const {
+		return kind == Kind::op && mnemonic == m;
+	}
+};
+
+// Instruction stream for one section of output. The Generator appends to
+// it; passes rewrite it in place and render() produces the NASM text.
+class InstrList {
+public:
+	void emit(std::string mnemonic, std::string dst = {}, std::string src = {}) {
+		m_instrs.push_back(Instr { Instr::Kind::op, std::move(mnemonic), std::move(dst), std::move(src) });
+	}
+
+	void label(std::string name) {
+		m_instrs.push_back(Instr { Instr::Kind::label, std::move(name) });
+	}
+
+	[[nodiscard]] std::vector<Instr>& instrs() {
+		return m_instrs;
+	}
+
+	[[nodiscard]] const std::vector<Instr>& instrs() const {
+		return m_instrs;
+	}
+
+	[[nodiscard]] bool empty() const {
+		return m_instrs.empty();
+	}
+
+	void render(AsmBuffer& out) const {
+		for (const Instr& instr : m_instrs) {
+			if (instr.kind == Instr::Kind::label) {
+				out.append(instr.mnemonic);
+				out.append(":\n");
+				continue;
+			}
+			out.append('\t');
+			out.append(instr.mnemonic);
+			if (!instr.dst.empty()) {
+				out.append(' ');
+				out.append(instr.dst);
+			}
+			if (!instr.src.empty()) {
+				out.append(", ");
+				out.append(instr.src);
+			}
+			out.append('\n');
+		}
+	}
+
+private:
+	std::vector<Instr> m_instrs {};
+};
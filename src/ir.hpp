@@ -0,0 +1,531 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+#include "./fold.hpp"
+#include "./parser.hpp"
+#include "./symbols.hpp"
+
+// SSA intermediate representation. A function is a list of basic blocks;
+// every value is defined exactly once, and values that merge at a join are
+// phi instructions at the top of the block with one operand per
+// predecessor, in IrBlock::preds order. Each block ends in one terminator
+// (jump, branch or ret).
+using ValueId = uint32_t;
+using BlockId = uint32_t;
+
+inline constexpr ValueId no_value = std::numeric_limits<ValueId>::max();
+
+enum class IrOp : uint8_t {
+	constant, // dst = imm
+	param, // dst = parameter number imm
+	add, // dst = args[0] + args[1]
+	sub,
+	mul,
+	div, // unsigned
+	copy, // dst = args[0]
+	phi, // dst = args[i] when entered from preds[i]
+	print, // prints args[0] as a decimal line
+	exit, // exits the process with args[0]
+	call, // dst = function imm called with args; dst may be no_value
+	jump, // to target
+	branch, // to target if args[0] != 0, else to alt
+	ret // returns args[0], or 0 without args
+};
+
+struct IrInstr {
+	IrOp op;
+	ValueId dst = no_value;
+	std::vector<ValueId> args {};
+	int64_t imm = 0;
+	BlockId target = 0;
+	BlockId alt = 0;
+
+	[[nodiscard]] bool is_terminator() const {
+		return op == IrOp::jump || op == IrOp::branch || op == IrOp::ret;
+	}
+};
+
+struct IrBlock {
+	std::vector<IrInstr> instrs {};
+	std::vector<BlockId> preds {};
+};
+
+struct IrFunction {
+	std::string name;
+	uint32_t num_params = 0;
+	uint32_t num_values = 0;
+	std::vector<IrBlock> blocks {};
+
+	[[nodiscard]] size_t num_instrs() const {
+		size_t count = 0;
+		for (const IrBlock& block : blocks) {
+			count += block.instrs.size();
+		}
+		return count;
+	}
+};
+
+// functions[0] is the program entry point.
+struct IrModule {
+	std::vector<IrFunction> functions {};
+
+	[[nodiscard]] size_t num_instrs() const {
+		size_t count = 0;
+		for (const IrFunction& function : functions) {
+			count += function.num_instrs();
+		}
+		return count;
+	}
+};
+
+inline const char* ir_op_name(const IrOp op) {
+	switch (op) {
+	case IrOp::constant:
+		return "const";
+	case IrOp::param:
+		return "param";
+	case IrOp::add:
+		return "add";
+	case IrOp::sub:
+		return "sub";
+	case IrOp::mul:
+		return "mul";
+	case IrOp::div:
+		return "div";
+	case IrOp::copy:
+		return "copy";
+	case IrOp::phi:
+		return "phi";
+	case IrOp::print:
+		return "print";
+	case IrOp::exit:
+		return "exit";
+	case IrOp::call:
+		return "call";
+	case IrOp::jump:
+		return "jump";
+	case IrOp::branch:
+		return "branch";
+	case IrOp::ret:
+		return "ret";
+	}
+	return "?";
+}
+
+inline void dump_ir(const IrModule& module, std::ostream& out) {
+	for (const IrFunction& function : module.functions) {
+		out << "function " << function.name << "(" << function.num_params << ")\n";
+		for (BlockId b = 0; b < function.blocks.size(); b++) {
+			const IrBlock& block = function.blocks[b];
+			out << "b" << b << ":";
+			for (const BlockId pred : block.preds) {
+				out << " <- b" << pred;
+			}
+			out << "\n";
+			for (const IrInstr& instr : block.instrs) {
+				out << "\t";
+				if (instr.dst != no_value) {
+					out << "v" << instr.dst << " = ";
+				}
+				out << ir_op_name(instr.op);
+				if (instr.op == IrOp::constant || instr.op == IrOp::param || instr.op == IrOp::call) {
+					out << " " << instr.imm;
+				}
+				for (const ValueId arg : instr.args) {
+					out << " v" << arg;
+				}
+				if (instr.op == IrOp::jump || instr.op == IrOp::branch) {
+					out << " b" << instr.target;
+				}
+				if (instr.op == IrOp::branch) {
+					out << " b" << instr.alt;
+				}
+				out << "\n";
+			}
+		}
+	}
+}
+
+// Builds SSA directly from the AST with the algorithm of Braun et al.,
+// "Simple and Efficient Construction of Static Single Assignment Form":
+// variables are looked up backwards through the predecessors on demand,
+// and a block is sealed once all its predecessors are known, at which
+// point the phis that were left incomplete get their operands. Control flow
+// is structured, so every block is sealed as soon as its construct ends.
+//
+// Every let and assignment is a copy, so a variable never aliases the value
+// it was given; copy propagation removes them again.
+class IrBuilder {
+public:
+	[[nodiscard]] static IrModule build(const NodeProg& prog) {
+		IrBuilder builder;
+		builder.m_module.functions.push_back(IrFunction { "_start" });
+		builder.m_function = 0;
+		builder.m_block = builder.new_block();
+		builder.seal(builder.m_block);
+		builder.build_stmts(prog.stmts);
+		builder.emit(IrInstr { IrOp::ret });
+		return std::move(builder.m_module);
+	}
+
+private:
+	// Variables are SymbolIds; for-loop counters get keys from the top of
+	// the range down, where no interned symbol reaches.
+	using VarKey = uint32_t;
+
+	struct BlockState {
+		std::unordered_map<VarKey, ValueId> defs {};
+		std::vector<std::pair<VarKey, ValueId>> incomplete_phis {};
+		bool sealed = false;
+	};
+
+	struct FunctionState {
+		uint32_t function;
+		BlockId block;
+		std::vector<BlockState> blocks;
+		ScopedSymbolTable<bool> vars;
+	};
+
+	IrFunction& function() {
+		return m_module.functions[m_function];
+	}
+
+	BlockId new_block() {
+		function().blocks.emplace_back();
+		m_blocks.emplace_back();
+		return static_cast<BlockId>(function().blocks.size() - 1);
+	}
+
+	ValueId new_value() {
+		return function().num_values++;
+	}
+
+	void emit(IrInstr instr) {
+		function().blocks[m_block].instrs.push_back(std::move(instr));
+	}
+
+	ValueId emit_value(const IrOp op, std::vector<ValueId> args, const int64_t imm = 0) {
+		const ValueId dst = new_value();
+		emit(IrInstr { op, dst, std::move(args), imm });
+		return dst;
+	}
+
+	void add_edge(const BlockId from, const BlockId to) {
+		function().blocks[to].preds.push_back(from);
+	}
+
+	void jump(const BlockId target) {
+		emit(IrInstr { .op = IrOp::jump, .target = target });
+		add_edge(m_block, target);
+	}
+
+	void branch(const ValueId cond, const BlockId target, const BlockId alt) {
+		emit(IrInstr { .op = IrOp::branch, .args = { cond }, .target = target, .alt = alt });
+		add_edge(m_block, target);
+		add_edge(m_block, alt);
+	}
+
+	void write_var(const VarKey var, const BlockId block, const ValueId value) {
+		m_blocks[block].defs[var] = value;
+	}
+
+	ValueId read_var(const VarKey var, const BlockId block) {
+		const auto it = m_blocks[block].defs.find(var);
+		if (it != m_blocks[block].defs.end()) {
+			return it->second;
+		}
+		return read_var_recursive(var, block);
+	}
+
+	ValueId read_var_recursive(const VarKey var, const BlockId block) {
+		const std::vector<BlockId>& preds = function().blocks[block].preds;
+		ValueId value;
+		if (!m_blocks[block].sealed) {
+			value = new_phi(block);
+			m_blocks[block].incomplete_phis.emplace_back(var, value);
+		} else if (preds.empty()) {
+			// Read before any write on some path (a let inside an if body
+			// that is used after it): undefined, so zero.
+			value = new_value();
+			auto& instrs = function().blocks[block].instrs;
+			instrs.insert(instrs.begin(), IrInstr { IrOp::constant, value });
+		} else if (preds.size() == 1) {
+			value = read_var(var, preds[0]);
+		} else {
+			value = new_phi(block);
+			write_var(var, block, value);
+			add_phi_operands(var, block, value);
+		}
+		write_var(var, block, value);
+		return value;
+	}
+
+	ValueId new_phi(const BlockId block) {
+		const ValueId value = new_value();
+		auto& instrs = function().blocks[block].instrs;
+		instrs.insert(instrs.begin(), IrInstr { IrOp::phi, value });
+		return value;
+	}
+
+	void add_phi_operands(const VarKey var, const BlockId block, const ValueId phi) {
+		std::vector<ValueId> args;
+		for (const BlockId pred : function().blocks[block].preds) {
+			args.push_back(read_var(var, pred));
+		}
+		// Reads may have inserted other phis in front of this one.
+		for (IrInstr& instr : function().blocks[block].instrs) {
+			if (instr.op == IrOp::phi && instr.dst == phi) {
+				instr.args = std::move(args);
+				return;
+			}
+		}
+	}
+
+	void seal(const BlockId block) {
+		m_blocks[block].sealed = true;
+		const auto incomplete = std::move(m_blocks[block].incomplete_phis);
+		for (const auto& [var, phi] : incomplete) {
+			add_phi_operands(var, block, phi);
+		}
+	}
+
+	void build_stmts(const std::pmr::vector<NodeStmt*>& stmts) {
+		for (const NodeStmt* stmt : stmts) {
+			build_stmt(stmt);
+		}
+	}
+
+	void build_stmt(const NodeStmt* stmt) {
+		struct StmtVisitor {
+			IrBuilder* builder;
+			void operator()(const NodeStmtExit* stmt_exit) const {
+				const ValueId value = builder->build_expr(stmt_exit->expr);
+				builder->emit(IrInstr { IrOp::exit, no_value, { value } });
+			}
+			void operator()(const NodeStmtLet* stmt_let) const {
+				if (builder->m_vars.find(stmt_let->ident.symbol) != nullptr) {
+					std::cerr << "Identifier already used: " << stmt_let->ident.value.value() << std::endl;
+					exit(EXIT_FAILURE);
+				}
+				const ValueId value = builder->build_expr(stmt_let->expr);
+				builder->m_vars.bind(stmt_let->ident.symbol, true);
+				builder->write_var(stmt_let->ident.symbol, builder->m_block, builder->emit_value(IrOp::copy, { value }));
+			}
+			void operator()(const NodeStmtPrint* stmt_print) const {
+				const ValueId value = builder->build_expr(stmt_print->expr);
+				builder->emit(IrInstr { IrOp::print, no_value, { value } });
+			}
+			void operator()(const NodeScope* scope) const {
+				builder->m_vars.begin_scope();
+				builder->build_stmts(scope->stmts);
+				builder->m_vars.end_scope();
+			}
+			void operator()(const NodeStmtIf* stmt_if) const {
+				const ValueId cond = builder->build_expr(stmt_if->cond);
+				const BlockId then_block = builder->new_block();
+				const BlockId join_block = builder->new_block();
+				builder->branch(cond, then_block, join_block);
+				builder->seal(then_block);
+				builder->m_block = then_block;
+				// The body is its own scope, as in the Generator.
+				builder->m_vars.begin_scope();
+				builder->build_stmts(stmt_if->scope->stmts);
+				builder->m_vars.end_scope();
+				builder->jump(join_block);
+				builder->seal(join_block);
+				builder->m_block = join_block;
+			}
+			void operator()(const NodeStmtFor* stmt_for) const {
+				// Counts from to - from down to zero, testing at the top like
+				// the stack-machine loop.
+				const ValueId from = builder->build_expr(stmt_for->from);
+				const ValueId to = builder->build_expr(stmt_for->to);
+				const VarKey counter = builder->m_next_loop_key--;
+				builder->write_var(counter, builder->m_block, builder->emit_value(IrOp::sub, { to, from }));
+
+				const BlockId header = builder->new_block();
+				const BlockId body = builder->new_block();
+				const BlockId exit_block = builder->new_block();
+				builder->jump(header);
+				builder->m_block = header;
+				builder->branch(builder->read_var(counter, header), body, exit_block);
+				builder->seal(body);
+				builder->seal(exit_block);
+
+				builder->m_block = body;
+				builder->m_vars.begin_scope();
+				builder->build_stmts(stmt_for->scope->stmts);
+				builder->m_vars.end_scope();
+				const ValueId one = builder->emit_value(IrOp::constant, {}, 1);
+				const ValueId next = builder->emit_value(IrOp::sub, { builder->read_var(counter, builder->m_block), one });
+				builder->write_var(counter, builder->m_block, next);
+				builder->jump(header);
+				builder->seal(header);
+				builder->m_block = exit_block;
+			}
+			void operator()(const NodeStmtAssign* stmt_assign) const {
+				if (builder->m_vars.find(stmt_assign->ident.symbol) == nullptr) {
+					std::cerr << "Undeclared identifier: " << stmt_assign->ident.value.value() << std::endl;
+					exit(EXIT_FAILURE);
+				}
+				const ValueId value = builder->build_expr(stmt_assign->expr);
+				builder->write_var(stmt_assign->ident.symbol, builder->m_block, builder->emit_value(IrOp::copy, { value }));
+			}
+			void operator()(const NodeStmtFunction* stmt_function) const {
+				builder->build_function(stmt_function);
+			}
+			void operator()(const NodeStmtFunctionCall* stmt_call) const {
+				builder->build_call(stmt_call->ident, stmt_call->args, no_value);
+			}
+			void operator()(const NodeStmtReturn* stmt_return) const {
+				if (builder->m_function == 0) {
+					std::cerr << "Return outside of a function" << std::endl;
+					exit(EXIT_FAILURE);
+				}
+				const ValueId value = builder->build_expr(stmt_return->expr);
+				builder->emit(IrInstr { IrOp::ret, no_value, { value } });
+				// Anything after the return is unreachable.
+				builder->m_block = builder->new_block();
+				builder->seal(builder->m_block);
+			}
+		};
+		std::visit(StmtVisitor { this }, stmt->var);
+	}
+
+	void build_call(const Token& ident, const std::pmr::vector<NodeExpr*>& args, const ValueId dst) {
+		const auto it = m_functions.find(ident.symbol);
+		if (it == m_functions.end()) {
+			std::cerr << "Undeclared function identifier: " << ident.value.value() << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		if (args.size() != m_module.functions[it->second].num_params) {
+			std::cerr << "Wrong number of arguments to " << ident.value.value() << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		std::vector<ValueId> values;
+		for (const NodeExpr* arg : args) {
+			values.push_back(build_expr(arg));
+		}
+		emit(IrInstr { IrOp::call, dst, std::move(values), it->second });
+	}
+
+	// Functions only see their parameters and their own locals.
+	void build_function(const NodeStmtFunction* stmt_function) {
+		if (m_functions.contains(stmt_function->ident.symbol)) {
+			std::cerr << "Already declared function identifier: " << stmt_function->ident.value.value() << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		const auto index = static_cast<uint32_t>(m_module.functions.size());
+		m_functions.emplace(stmt_function->ident.symbol, index);
+		m_module.functions.push_back(IrFunction {
+			std::string(stmt_function->ident.value.value()) + "_" + std::to_string(index - 1),
+			static_cast<uint32_t>(stmt_function->args.size()) });
+
+		FunctionState outer { m_function, m_block, std::move(m_blocks), std::move(m_vars) };
+		m_function = index;
+		m_blocks = {};
+		m_vars = {};
+		m_block = new_block();
+		seal(m_block);
+		for (size_t i = 0; i < stmt_function->args.size(); i++) {
+			const auto* param = std::get_if<NodeTermIdent*>(&stmt_function->args[i]->var);
+			if (param == nullptr) {
+				std::cerr << "Invalid parameter" << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			m_vars.bind((*param)->ident.symbol, true);
+			write_var((*param)->ident.symbol, m_block, emit_value(IrOp::param, {}, static_cast<int64_t>(i)));
+		}
+		build_stmts(stmt_function->scope->stmts);
+		emit(IrInstr { IrOp::ret });
+
+		m_function = outer.function;
+		m_block = outer.block;
+		m_blocks = std::move(outer.blocks);
+		m_vars = std::move(outer.vars);
+	}
+
+	ValueId build_expr(const NodeExpr* expr) {
+		struct ExprVisitor {
+			IrBuilder* builder;
+			ValueId operator()(const NodeTerm* term) const {
+				return builder->build_term(term);
+			}
+			ValueId operator()(const NodeBinExpr* bin_expr) const {
+				return builder->build_bin_expr(bin_expr);
+			}
+		};
+		return std::visit(ExprVisitor { this }, expr->var);
+	}
+
+	ValueId build_term(const NodeTerm* term) {
+		struct TermVisitor {
+			IrBuilder* builder;
+			ValueId operator()(const NodeTermIntLit* term_int_lit) const {
+				const std::optional<int64_t> value = parse_int_lit(term_int_lit->int_lit.value.value());
+				if (!value.has_value()) {
+					std::cerr << "Integer literal out of range: " << term_int_lit->int_lit.value.value() << std::endl;
+					exit(EXIT_FAILURE);
+				}
+				return builder->emit_value(IrOp::constant, {}, *value);
+			}
+			ValueId operator()(const NodeTermIdent* term_ident) const {
+				if (builder->m_vars.find(term_ident->ident.symbol) == nullptr) {
+					std::cerr << "Undeclared identifier: " << term_ident->ident.value.value() << std::endl;
+					exit(EXIT_FAILURE);
+				}
+				return builder->read_var(term_ident->ident.symbol, builder->m_block);
+			}
+			ValueId operator()(const NodeTermParen* term_paren) const {
+				return builder->build_expr(term_paren->expr);
+			}
+			ValueId operator()(const NodeTermCall* term_call) const {
+				const ValueId dst = builder->new_value();
+				builder->build_call(term_call->ident, term_call->args, dst);
+				return dst;
+			}
+		};
+		return std::visit(TermVisitor { this }, term->var);
+	}
+
+	ValueId build_bin_expr(const NodeBinExpr* bin_expr) {
+		struct BinExprVisitor {
+			IrBuilder* builder;
+			ValueId operator()(const NodeBinExprAdd* add) const {
+				return builder->build_op(IrOp::add, add->lhs, add->rhs);
+			}
+			ValueId operator()(const NodeBinExprMinus* sub) const {
+				return builder->build_op(IrOp::sub, sub->lhs, sub->rhs);
+			}
+			ValueId operator()(const NodeBinExprMulti* multi) const {
+				return builder->build_op(IrOp::mul, multi->lhs, multi->rhs);
+			}
+			ValueId operator()(const NodeBinExprDiv* div) const {
+				return builder->build_op(IrOp::div, div->lhs, div->rhs);
+			}
+		};
+		return std::visit(BinExprVisitor { this }, bin_expr->var);
+	}
+
+	ValueId build_op(const IrOp op, const NodeExpr* lhs, const NodeExpr* rhs) {
+		const ValueId lhs_value = build_expr(lhs);
+		const ValueId rhs_value = build_expr(rhs);
+		return emit_value(op, { lhs_value, rhs_value });
+	}
+
+	IrModule m_module {};
+	uint32_t m_function = 0;
+	BlockId m_block = 0;
+	std::vector<BlockState> m_blocks {};
+	ScopedSymbolTable<bool> m_vars {};
+	std::unordered_map<SymbolId, uint32_t> m_functions {};
+	VarKey m_next_loop_key = no_symbol - 1;
+};
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "./instructions.hpp"
+#include "./ir.hpp"
+#include "./peephole.hpp"
+#include "./runtime.hpp"
+
+// Lowers an IrModule to NASM text. Every value that is still defined gets
+// its own 8-byte slot in an rbp-based frame and each instruction goes
+// through rax, so this is a straightforward baseline for the IR passes to
+// improve on rather than a register allocator.
+//
+// Phis are resolved on the edges: the predecessor pushes all operands of
+// the target's phis and pops them into the phi slots, which makes the
+// copies parallel. Calls follow SysV: six arguments in registers, the rest
+// on the stack, the result in rax.
+class IrLowering {
+public:
+	explicit IrLowering(const PeepholeRuleSet peephole_rules = PeepholeRuleSet().set())
+		: m_peephole(peephole_rules)
+	{
+	}
+
+	[[nodiscard]] AsmBuffer lower(const IrModule& module) {
+		AsmBuffer out;
+		out.append("global _start\n");
+		for (uint32_t f = 0; f < module.functions.size(); f++) {
+			InstrList instrs;
+			lower_function(module, f, instrs);
+			m_peephole.run(instrs.instrs());
+			if (f > 0) {
+				out.append('\n');
+			}
+			instrs.render(out);
+		}
+		out.append(runtime_asm);
+		return out;
+	}
+
+	[[nodiscard]] const Peephole& peephole() const {
+		return m_peephole;
+	}
+
+private:
+	static constexpr std::array<const char*, 6> arg_regs { "rdi", "rsi", "rdx", "rcx", "r8", "r9" };
+
+	void lower_function(const IrModule& module, const uint32_t f, InstrList& out) {
+		const IrFunction& function = module.functions[f];
+		m_module = &module;
+		m_function_index = f;
+		m_slots.assign(function.num_values, 0);
+		size_t num_slots = 0;
+		for (const IrBlock& block : function.blocks) {
+			for (const IrInstr& instr : block.instrs) {
+				if (instr.dst != no_value) {
+					m_slots[instr.dst] = ++num_slots;
+				}
+			}
+		}
+
+		out.label(function.name);
+		out.emit("push", "rbp");
+		out.emit("mov", "rbp", "rsp");
+		if (num_slots > 0) {
+			out.emit("sub", "rsp", std::to_string(num_slots * 8));
+		}
+		for (BlockId b = 0; b < function.blocks.size(); b++) {
+			out.label(block_label(f, b));
+			for (const IrInstr& instr : function.blocks[b].instrs) {
+				lower_instr(function, b, instr, out);
+			}
+		}
+	}
+
+	void lower_instr(const IrFunction& function, const BlockId block, const IrInstr& instr, InstrList& out) {
+		switch (instr.op) {
+		case IrOp::constant:
+			if (instr.imm >= INT32_MIN && instr.imm <= INT32_MAX) {
+				out.emit("mov", slot(instr.dst), std::to_string(instr.imm));
+			} else {
+				out.emit("mov", "rax", std::to_string(instr.imm));
+				out.emit("mov", slot(instr.dst), "rax");
+			}
+			break;
+		case IrOp::param:
+			if (static_cast<size_t>(instr.imm) < arg_regs.size()) {
+				out.emit("mov", slot(instr.dst), arg_regs[static_cast<size_t>(instr.imm)]);
+			} else {
+				// Above the saved rbp and the return address.
+				out.emit("mov", "rax", "QWORD [rbp + " + std::to_string(16 + (instr.imm - arg_regs.size()) * 8) + "]");
+				out.emit("mov", slot(instr.dst), "rax");
+			}
+			break;
+		case IrOp::add:
+		case IrOp::sub:
+		case IrOp::mul:
+			out.emit("mov", "rax", slot(instr.args[0]));
+			out.emit(instr.op == IrOp::add ? "add" : instr.op == IrOp::sub ? "sub" : "imul", "rax", slot(instr.args[1]));
+			out.emit("mov", slot(instr.dst), "rax");
+			break;
+		case IrOp::div:
+			out.emit("mov", "rax", slot(instr.args[0]));
+			out.emit("xor", "edx", "edx");
+			out.emit("div", slot(instr.args[1]));
+			out.emit("mov", slot(instr.dst), "rax");
+			break;
+		case IrOp::copy:
+			out.emit("mov", "rax", slot(instr.args[0]));
+			out.emit("mov", slot(instr.dst), "rax");
+			break;
+		case IrOp::phi:
+			break;
+		case IrOp::print:
+			out.emit("mov", "rdi", slot(instr.args[0]));
+			out.emit("call", "mine_print_int");
+			break;
+		case IrOp::exit:
+			out.emit("mov", "rdi", slot(instr.args[0]));
+			out.emit("call", "mine_exit");
+			break;
+		case IrOp::call: {
+			const size_t num_args = instr.args.size();
+			for (size_t i = num_args; i > arg_regs.size(); i--) {
+				out.emit("push", slot(instr.args[i - 1]));
+			}
+			for (size_t i = 0; i < std::min(num_args, arg_regs.size()); i++) {
+				out.emit("mov", arg_regs[i], slot(instr.args[i]));
+			}
+			out.emit("call", m_module->functions[static_cast<size_t>(instr.imm)].name);
+			if (num_args > arg_regs.size()) {
+				out.emit("add", "rsp", std::to_string((num_args - arg_regs.size()) * 8));
+			}
+			if (instr.dst != no_value) {
+				out.emit("mov", slot(instr.dst), "rax");
+			}
+			break;
+		}
+		case IrOp::jump:
+			lower_edge(function, block, instr.target, out);
+			break;
+		case IrOp::branch: {
+			// The false edge gets its own stub only when it has phi copies.
+			const bool alt_copies = has_phis(function.blocks[instr.alt]);
+			const std::string alt_label = alt_copies ? block_label(m_function_index, block) + "_alt" : block_label(m_function_index, instr.alt);
+			out.emit("cmp", slot(instr.args[0]), "0");
+			out.emit("je", alt_label);
+			lower_edge(function, block, instr.target, out, alt_copies);
+			if (alt_copies) {
+				out.label(alt_label);
+				lower_edge(function, block, instr.alt, out);
+			}
+			break;
+		}
+		case IrOp::ret:
+			if (m_function_index == 0) {
+				out.emit("mov", "rdi", "0");
+				out.emit("call", "mine_exit");
+			} else {
+				if (instr.args.empty()) {
+					out.emit("xor", "eax", "eax");
+				} else {
+					out.emit("mov", "rax", slot(instr.args[0]));
+				}
+				out.emit("mov", "rsp", "rbp");
+				out.emit("pop", "rbp");
+				out.emit("ret");
+			}
+			break;
+		}
+	}
+
+	[[nodiscard]] static bool has_phis(const IrBlock& block) {
+		return !block.instrs.empty() && block.instrs.front().op == IrOp::phi;
+	}
+
+	// Copies the phi operands for the edge from -> to, then jumps unless
+	// `to` is laid out next and nothing else follows.
+	void lower_edge(const IrFunction& function, const BlockId from, const BlockId to, InstrList& out, const bool must_jump = false) {
+		const IrBlock& target = function.blocks[to];
+		size_t pred = 0;
+		while (target.preds[pred] != from) {
+			pred++;
+		}
+		std::vector<ValueId> phis;
+		for (const IrInstr& instr : target.instrs) {
+			if (instr.op != IrOp::phi) {
+				break;
+			}
+			out.emit("push", slot(instr.args[pred]));
+			phis.push_back(instr.dst);
+		}
+		for (auto it = phis.rbegin(); it != phis.rend(); ++it) {
+			out.emit("pop", slot(*it));
+		}
+		if (must_jump || to != from + 1) {
+			out.emit("jmp", block_label(m_function_index, to));
+		}
+	}
+
+	[[nodiscard]] std::string slot(const ValueId value) const {
+		return "QWORD [rbp - " + std::to_string(m_slots[value] * 8) + "]";
+	}
+
+	[[nodiscard]] static std::string block_label(const uint32_t function, const BlockId block) {
+		return "ir" + std::to_string(function) + "_b" + std::to_string(block);
+	}
+
+	Peephole m_peephole;
+	const IrModule* m_module = nullptr;
+	uint32_t m_function_index = 0;
+	std::vector<size_t> m_slots {};
+};
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <iomanip>
+#include <ostream>
+#include <string_view>
+#include <vector>
+
+#include "./ir.hpp"
+
+namespace ir_detail {
+
+// Follows forwarding links to the value that replaced `value`.
+inline ValueId resolve(std::vector<ValueId>& forward, ValueId value) {
+	ValueId root = value;
+	while (forward[root] != root) {
+		root = forward[root];
+	}
+	while (forward[value] != root) {
+		const ValueId next = forward[value];
+		forward[value] = root;
+		value = next;
+	}
+	return root;
+}
+
+// Replaces copies with their source and phis whose operands are all the
+// same value (or the phi itself) with that value, until nothing changes,
+// then rewrites every use and drops the replaced instructions.
+inline size_t copy_propagation(IrFunction& function) {
+	std::vector<ValueId> forward(function.num_values);
+	for (ValueId v = 0; v < function.num_values; v++) {
+		forward[v] = v;
+	}
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (const IrBlock& block : function.blocks) {
+			for (const IrInstr& instr : block.instrs) {
+				if (instr.dst == no_value || resolve(forward, instr.dst) != instr.dst) {
+					continue;
+				}
+				ValueId same = no_value;
+				if (instr.op == IrOp::copy) {
+					same = resolve(forward, instr.args[0]);
+				} else if (instr.op == IrOp::phi) {
+					for (const ValueId arg : instr.args) {
+						const ValueId value = resolve(forward, arg);
+						if (value == instr.dst || value == same) {
+							continue;
+						}
+						if (same != no_value) {
+							same = no_value;
+							break;
+						}
+						same = value;
+					}
+				}
+				if (same != no_value && same != instr.dst) {
+					forward[instr.dst] = same;
+					changed = true;
+				}
+			}
+		}
+	}
+
+	size_t removed = 0;
+	for (IrBlock& block : function.blocks) {
+		std::vector<IrInstr> kept;
+		kept.reserve(block.instrs.size());
+		for (IrInstr& instr : block.instrs) {
+			if (instr.dst != no_value && resolve(forward, instr.dst) != instr.dst) {
+				removed++;
+				continue;
+			}
+			for (ValueId& arg : instr.args) {
+				arg = resolve(forward, arg);
+			}
+			kept.push_back(std::move(instr));
+		}
+		block.instrs = std::move(kept);
+	}
+	return removed;
+}
+
+// Division by zero traps, so a division stays unless its divisor is a
+// nonzero constant.
+inline bool has_side_effects(const IrInstr& instr, const std::vector<const IrInstr*>& defs) {
+	switch (instr.op) {
+	case IrOp::print:
+	case IrOp::exit:
+	case IrOp::call:
+	case IrOp::jump:
+	case IrOp::branch:
+	case IrOp::ret:
+		return true;
+	case IrOp::div: {
+		const IrInstr* divisor = defs[instr.args[1]];
+		return divisor == nullptr || divisor->op != IrOp::constant || divisor->imm == 0;
+	}
+	default:
+		return false;
+	}
+}
+
+// Marks everything reachable through operands from the instructions with
+// side effects and deletes the rest.
+inline size_t dead_code_elimination(IrFunction& function) {
+	std::vector<const IrInstr*> defs(function.num_values, nullptr);
+	for (const IrBlock& block : function.blocks) {
+		for (const IrInstr& instr : block.instrs) {
+			if (instr.dst != no_value) {
+				defs[instr.dst] = &instr;
+			}
+		}
+	}
+
+	std::vector<bool> live(function.num_values, false);
+	std::vector<ValueId> worklist;
+	auto mark = [&](const IrInstr& instr) {
+		for (const ValueId arg : instr.args) {
+			if (!live[arg]) {
+				live[arg] = true;
+				worklist.push_back(arg);
+			}
+		}
+	};
+	for (const IrBlock& block : function.blocks) {
+		for (const IrInstr& instr : block.instrs) {
+			if (has_side_effects(instr, defs)) {
+				if (instr.dst != no_value) {
+					live[instr.dst] = true;
+				}
+				mark(instr);
+			}
+		}
+	}
+	while (!worklist.empty()) {
+		const ValueId value = worklist.back();
+		worklist.pop_back();
+		if (defs[value] != nullptr) {
+			mark(*defs[value]);
+		}
+	}
+
+	size_t removed = 0;
+	for (IrBlock& block : function.blocks) {
+		const size_t before = block.instrs.size();
+		std::erase_if(block.instrs, [&](const IrInstr& instr) {
+			return instr.dst != no_value && !live[instr.dst];
+		});
+		removed += before - block.instrs.size();
+	}
+	return removed;
+}
+
+} // namespace ir_detail
+
+struct IrPass {
+	std::string_view name;
+	// Returns how many instructions the pass removed from `function`.
+	size_t (*run)(IrFunction& function);
+};
+
+inline constexpr std::array<IrPass, 2> ir_passes {
+	IrPass { "copy-prop", ir_detail::copy_propagation },
+	IrPass { "dce", ir_detail::dead_code_elimination },
+};
+
+using IrPassSet = std::bitset<ir_passes.size()>;
+
+// Returns the index of the pass called `name` in ir_passes, or
+// ir_passes.size() when there is none.
+[[nodiscard]] inline size_t find_ir_pass(const std::string_view name) {
+	size_t i = 0;
+	while (i < ir_passes.size() && ir_passes[i].name != name) {
+		i++;
+	}
+	return i;
+}
+
+// Runs the enabled passes in table order over every function and keeps the
+// instruction count after each, so every pass's effect can be read off on
+// its own.
+class IrPipeline {
+public:
+	explicit IrPipeline(const IrPassSet enabled = IrPassSet().set())
+		: m_enabled(enabled)
+	{
+	}
+
+	void run(IrModule& module) {
+		m_instrs_before = module.num_instrs();
+		for (size_t i = 0; i < ir_passes.size(); i++) {
+			if (!m_enabled.test(i)) {
+				continue;
+			}
+			for (IrFunction& function : module.functions) {
+				m_removed[i] += ir_passes[i].run(function);
+			}
+		}
+		m_instrs_after = module.num_instrs();
+	}
+
+	void report(std::ostream& out) const {
+		out << std::left << std::setw(12) << "ir input" << std::right << std::setw(8) << m_instrs_before << " instructions" << std::endl;
+		for (size_t i = 0; i < ir_passes.size(); i++) {
+			out << std::left << std::setw(12) << ir_passes[i].name << std::right << std::setw(8) << m_removed[i] << " removed"
+				<< (m_enabled.test(i) ? "" : "  (disabled)") << std::endl;
+		}
+		out << std::left << std::setw(12) << "ir output" << std::right << std::setw(8) << m_instrs_after << " instructions" << std::endl;
+	}
+
+private:
+	IrPassSet m_enabled;
+	std::array<size_t, ir_passes.size()> m_removed {};
+	size_t m_instrs_before = 0;
+	size_t m_instrs_after = 0;
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "./assembler.hpp"
+
+// Runs assembled code in memory. The code and data are linked into an
+// mmap'd region in the low 2 GB (the encoder uses 32-bit absolute
+// addresses) and entered in a forked child, so the program's exit syscall
+// ends the child and not the compiler.
+class Jit {
+public:
+	struct Result {
+		bool exited = false;
+		int exit_code = 0;
+		int signal = 0;
+		// Set when the child could not be waited for; its status is unknown.
+		bool failed = false;
+	};
+
+	[[nodiscard]] static Result run(ObjectCode obj) {
+		const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+		const size_t text_size = align(obj.text.size(), page_size);
+		const size_t data_size = align(obj.data.size() + obj.bss_size, page_size);
+		const size_t total_size = text_size + (data_size == 0 ? page_size : data_size);
+
+		void* region = mmap(nullptr, total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+		if (region == MAP_FAILED) {
+			std::cerr << "Unable to map JIT region" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		auto* const text = static_cast<uint8_t*>(region);
+		uint8_t* const data = text + text_size;
+		const auto text_base = reinterpret_cast<uint64_t>(text);
+		const auto data_base = reinterpret_cast<uint64_t>(data);
+
+		obj.link(text_base, data_base);
+		// An empty section's vector may have a null data(), which memcpy
+		// must not be given even for zero bytes.
+		std::copy(obj.text.begin(), obj.text.end(), text);
+		std::copy(obj.data.begin(), obj.data.end(), data);
+		if (mprotect(text, text_size, PROT_READ | PROT_EXEC) != 0) {
+			std::cerr << "Unable to make JIT code executable" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		const uint64_t entry = obj.entry(text_base);
+
+		// Anything still buffered would otherwise be flushed twice.
+		std::cout.flush();
+		std::cerr.flush();
+		const pid_t pid = fork();
+		if (pid < 0) {
+			std::cerr << "Unable to fork" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		if (pid == 0) {
+			reinterpret_cast<void (*)()>(entry)();
+			_exit(0);
+		}
+
+		int status = 0;
+		pid_t waited = waitpid(pid, &status, 0);
+		while (waited < 0 && errno == EINTR) {
+			waited = waitpid(pid, &status, 0);
+		}
+		const int wait_error = errno;
+		munmap(region, total_size);
+
+		Result result;
+		if (waited < 0) {
+			std::cerr << "Unable to wait for the JIT process: " << std::strerror(wait_error) << std::endl;
+			result.failed = true;
+		} else if (WIFEXITED(status)) {
+			result.exited = true;
+			result.exit_code = WEXITSTATUS(status);
+		} else if (WIFSIGNALED(status)) {
+			result.signal = WTERMSIG(status);
+		}
+		return result;
+	}
+
+private:
+	static size_t align(const size_t value, const size_t alignment) {
+		return (value + alignment - 1) / alignment * alignment;
+	}
+};
@@ -1,51 +1,350 @@
-#include <fstream>
+#include <algorithm>
+#include <array>
 #include <iostream>
 #include <optional>
-#include <sstream>
 #include <vector>
 
 #include "./generation.hpp"
 #include "./arena.hpp"
+#include "./bench.hpp"
+#include "./cache.hpp"
+#include "./driver.hpp"
+#include "./elf.hpp"
+#include "./inline.hpp"
+#include "./ir_lower.hpp"
+#include "./ir_passes.hpp"
+#include "./jit.hpp"
+#include "./profile.hpp"
+#include "./source.hpp"
+
+// Counting replacements for the global allocation functions, read by the
+// --bench-alloc mode. They must live in exactly one translation unit.
+void* operator new(const size_t num_bytes)
+{
+	heap_allocations++;
+	if (void* pointer = std::malloc(num_bytes == 0 ? 1 : num_bytes)) {
+		return pointer;
+	}
+	throw std::bad_alloc {};
+}
+
+// GCC cannot see that operator new above is malloc-based once these are
+// inlined into callers, and reports the matching free() as a mismatch.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* pointer) noexcept
+{
+	std::free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept
+{
+	std::free(pointer);
+}
+#pragma GCC diagnostic pop
+
+static void usage()
+{
+	std::cerr << "Incorrect usage. Correct usage is..." << std::endl;
+	std::cerr << "mine [--stack-exprs [--flat-ast]] [--unroll=<n>] [--no-strength-reduce] [--inline-cost=<n>] [--inline-depth=<n>] [--inline-report] [--jobs=<n>] [--no-peephole[=<rule>]] [--peephole-report] [--nasm | --run] <input.me>" << std::endl;
+	std::cerr << "mine --ir [--inline-cost=<n>] [--inline-depth=<n>] [--inline-report] [--no-ir-pass=<pass>] [--ir-report] [--dump-ir] [--no-peephole[=<rule>]] [--nasm | --run] <input.me>" << std::endl;
+	std::cerr << "mine --batch [--manifest=<file>] [--out-dir=<dir>] [--jobs=<n>] [<compile options>] <input.me>..." << std::endl;
+	std::cerr << "  where <compile options> excludes --nasm, --run, --time-passes, --dump-ir and the --*-report flags" << std::endl;
+	std::cerr << "  add [--huge-pages] to back the parser's arena with huge pages" << std::endl;
+	std::cerr << "  add [--time-passes[=json]] to time each phase of a single-file compile" << std::endl;
+	std::cerr << "  without --run, add [--cache[=<dir>]] [--cache-size=<MiB>] [--cache-stats] to reuse executables of unchanged sources" << std::endl;
+	std::cerr << "mine --bench-lex <input.me>" << std::endl;
+	std::cerr << "mine --bench-alloc <input.me>" << std::endl;
+	std::cerr << "mine --bench-codegen <input.me>" << std::endl;
+	std::cerr << "mine --bench-arith <kernel.me>..." << std::endl;
+}
+
+// The arguments that change what is generated, as part of a cache key.
+static std::string output_flags(const int argc, char* argv[], const bool batch)
+{
+	static constexpr std::array<std::string_view, 11> ignored { "--cache", "--batch", "--manifest=", "--out-dir=", "--inline-report", "--peephole-report", "--ir-report", "--dump-ir", "--nasm", "--time-passes", "--huge-pages" };
+	std::string flags;
+	for (int i = 1; i < argc; i++) {
+		const std::string_view arg = argv[i];
+		const bool is_ignored = std::ranges::any_of(ignored, [&](const std::string_view prefix) { return arg.starts_with(prefix); });
+		// With --batch, --jobs only sets how many files compile at once.
+		if (!arg.starts_with("--") || is_ignored || (batch && arg.starts_with("--jobs="))) {
+			continue;
+		}
+		flags.append(arg);
+		flags.push_back('\0');
+	}
+	return flags;
+}
+
+static void execute_output()
+{
+	std::cout << "Executing... " << std::endl;
+	system("./output/out ; echo Exit code : $?");
+}
 
 int main(int argc, char* argv[])
 {
-	if (argc != 2) {
-		std::cerr << "Incorrect usage. Correct usage is..." << std::endl;
-		std::cerr << "mine <input.me>" << std::endl;
+	if (argc == 3 && std::string_view(argv[1]) == "--bench-lex") {
+		const SourceFile source(argv[2]);
+		bench_lex(source.view());
+		return EXIT_SUCCESS;
+	}
+
+	if (argc == 3 && std::string_view(argv[1]) == "--bench-alloc") {
+		const SourceFile source(argv[2]);
+		bench_alloc(source.view());
+		return EXIT_SUCCESS;
+	}
+
+	if (argc == 3 && std::string_view(argv[1]) == "--bench-codegen") {
+		const SourceFile source(argv[2]);
+		bench_codegen(source.view());
+		return EXIT_SUCCESS;
+	}
+
+	if (argc >= 3 && std::string_view(argv[1]) == "--bench-arith") {
+		bench_arith(std::span(argv + 2, argv + argc));
+		return EXIT_SUCCESS;
+	}
+
+	const char* input = nullptr;
+	GenOptions gen_options;
+	bool use_nasm = false;
+	bool run_in_memory = false;
+	bool peephole_report = false;
+	bool use_ir = false;
+	IrPassSet ir_pass_set = IrPassSet().set();
+	bool ir_report = false;
+	bool print_ir = false;
+	InlineOptions inline_options;
+	bool inline_report = false;
+	std::optional<size_t> jobs;
+	bool batch = false;
+	std::vector<std::string> batch_inputs;
+	std::string out_dir = "output";
+	std::optional<std::string> cache_dir;
+	uint64_t cache_mib = 256;
+	bool cache_stats = false;
+	bool time_passes = false;
+	bool time_passes_json = false;
+	bool huge_pages = false;
+	for (int i = 1; i < argc; i++) {
+		const std::string_view arg = argv[i];
+		if (arg == "--stack-exprs") {
+			gen_options.stack_exprs = true;
+		} else if (arg.starts_with("--unroll=")) {
+			gen_options.unroll_limit = std::strtoul(argv[i] + arg.find('=') + 1, nullptr, 10);
+		} else if (arg == "--no-strength-reduce") {
+			gen_options.strength_reduce = false;
+		} else if (arg.starts_with("--inline-cost=")) {
+			inline_options.max_cost = std::strtoul(argv[i] + arg.find('=') + 1, nullptr, 10);
+		} else if (arg.starts_with("--inline-depth=")) {
+			inline_options.max_depth = std::strtoul(argv[i] + arg.find('=') + 1, nullptr, 10);
+		} else if (arg == "--inline-report") {
+			inline_report = true;
+		} else if (arg.starts_with("--jobs=")) {
+			jobs = std::strtoul(argv[i] + arg.find('=') + 1, nullptr, 10);
+		} else if (arg == "--flat-ast") {
+			gen_options.flat_ast = true;
+		} else if (arg == "--no-peephole") {
+			gen_options.peephole_rules.reset();
+		} else if (arg.starts_with("--no-peephole=")) {
+			const std::string_view name = arg.substr(arg.find('=') + 1);
+			const size_t rule = find_peephole_rule(name);
+			if (rule == peephole_rules.size()) {
+				std::cerr << "Unknown peephole rule: " << name << std::endl;
+				return EXIT_FAILURE;
+			}
+			gen_options.peephole_rules.reset(rule);
+		} else if (arg == "--peephole-report") {
+			peephole_report = true;
+		} else if (arg == "--ir") {
+			use_ir = true;
+		} else if (arg.starts_with("--no-ir-pass=")) {
+			const std::string_view name = arg.substr(arg.find('=') + 1);
+			const size_t pass = find_ir_pass(name);
+			if (pass == ir_passes.size()) {
+				std::cerr << "Unknown IR pass: " << name << std::endl;
+				return EXIT_FAILURE;
+			}
+			ir_pass_set.reset(pass);
+		} else if (arg == "--ir-report") {
+			ir_report = true;
+		} else if (arg == "--dump-ir") {
+			print_ir = true;
+		} else if (arg == "--nasm") {
+			use_nasm = true;
+		} else if (arg == "--run") {
+			run_in_memory = true;
+		} else if (arg == "--batch") {
+			batch = true;
+		} else if (arg.starts_with("--manifest=")) {
+			const std::vector<std::string> listed = read_manifest(argv[i] + arg.find('=') + 1);
+			batch_inputs.insert(batch_inputs.end(), listed.begin(), listed.end());
+		} else if (arg == "--cache") {
+			cache_dir = ".mine-cache";
+		} else if (arg.starts_with("--cache=")) {
+			cache_dir = arg.substr(arg.find('=') + 1);
+		} else if (arg.starts_with("--cache-size=")) {
+			cache_mib = std::strtoull(argv[i] + arg.find('=') + 1, nullptr, 10);
+		} else if (arg == "--time-passes" || arg == "--time-passes=json") {
+			time_passes = true;
+			time_passes_json = arg.ends_with("=json");
+		} else if (arg == "--huge-pages") {
+			huge_pages = true;
+		} else if (arg == "--cache-stats") {
+			cache_stats = true;
+		} else if (arg.starts_with("--out-dir=")) {
+			out_dir = arg.substr(arg.find('=') + 1);
+		} else if (arg.starts_with("--") || (input != nullptr && !batch)) {
+			usage();
+			return EXIT_FAILURE;
+		} else if (batch) {
+			batch_inputs.emplace_back(arg);
+		} else {
+			input = argv[i];
+		}
+	}
+
+	// A batch runs nothing and reports nothing per file, and needs files.
+	const bool reports = inline_report || peephole_report || ir_report || print_ir || time_passes;
+	if (batch && (batch_inputs.empty() || use_nasm || run_in_memory || reports)) {
+		usage();
 		return EXIT_FAILURE;
 	}
 
-	std::string contents;
-	{
-		std::stringstream contents_stream;
-		std::fstream input(argv[1], std::ios::in);
-		contents_stream << input.rdbuf();
-		contents = contents_stream.str();
+	// Only files on disk are cached; --run never writes one.
+	std::optional<CompileCache> cache;
+	if (cache_dir.has_value() && !run_in_memory) {
+		cache.emplace(*cache_dir, cache_mib << 20);
 	}
+	const auto finish_cache = [&] {
+		if (cache.has_value()) {
+			cache->finish();
+			if (cache_stats) {
+				cache->report(std::cout);
+			}
+		}
+	};
+
+	if (batch) {
+		// Files are compiled in parallel instead of function bodies.
+		const BatchOptions options {
+			.compile = { .gen = gen_options, .inlining = inline_options, .ir = use_ir, .ir_passes = ir_pass_set, .huge_pages = huge_pages },
+			.out_dir = out_dir,
+			.jobs = jobs.value_or(0),
+			.cache = cache.has_value() ? &*cache : nullptr,
+			.cache_flags = output_flags(argc, argv, true),
+		};
+		BatchDriver::run(batch_inputs, options);
+		finish_cache();
+		return EXIT_SUCCESS;
+	}
+	gen_options.jobs = jobs.value_or(1);
+	if (input == nullptr || (use_nasm && run_in_memory)) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	PassProfiler profile(time_passes);
+	const SourceFile source = profile.time("read", [&] { return SourceFile(input); });
 
-	std::cout << contents << std::endl << std::endl;
+	std::cout << source.view() << std::endl << std::endl;
 
-	Tokenizer tokenizer(std::move(contents));
-	std::vector<Token> tokens = tokenizer.tokenize();
+	std::string cache_key;
+	if (cache.has_value()) {
+		cache_key = CompileCache::key(source.view(), output_flags(argc, argv, false));
+		if (profile.time("cache-fetch", [&] { return cache->fetch(cache_key, "output/out", "output/out.asm"); })) {
+			finish_cache();
+			profile.report(std::cerr, time_passes_json);
+			execute_output();
+			return EXIT_SUCCESS;
+		}
+	}
 
-	Parser parser(std::move(tokens));
-	std::optional<NodeProg> prog = parser.parse_prog();
+	// Tokens are lexed on demand, so "parse" includes tokenizing.
+	Tokenizer tokenizer(source.view());
+	ArenaAllocator arena(Parser::default_arena_bytes, huge_pages);
+	Parser parser(tokenizer, arena);
+	std::optional<NodeProg> prog = profile.time("parse", [&] { return parser.parse_prog(); });
 
 	if (!prog.has_value()) {
 		std::cerr << "Invalid program" << std::endl;
 		exit(EXIT_FAILURE);
 	}
+	if (profile.enabled()) {
+		profile.count("tokens", parser.num_tokens());
+		profile.count("ast_nodes", count_ast_nodes(prog->stmts));
+	}
+	Inliner inliner(parser.arena(), inline_options);
+	profile.time("inline", [&] { inliner.run(prog.value()); });
+	if (inline_report) {
+		inliner.report(std::cout);
+	}
+	profile.time("fold", [&] { ConstantFolder(parser.arena()).run(prog.value()); });
+	const ArenaAllocator::Stats arena_stats = parser.arena_stats();
+	profile.count("arena_bytes_used", arena_stats.bytes_used);
+	profile.count("arena_bytes_reserved", arena_stats.bytes_reserved);
 
-	Generator generator(prog.value());
-	{
-		std::fstream file("output/out.asm", std::ios::out);
-		file << generator.gen_prog();
+	AsmBuffer asm_text;
+	if (use_ir) {
+		IrModule module = profile.time("ir-build", [&] { return IrBuilder::build(prog.value()); });
+		IrPipeline pipeline(ir_pass_set);
+		profile.time("ir-passes", [&] { pipeline.run(module); });
+		if (print_ir) {
+			dump_ir(module, std::cout);
+		}
+		if (ir_report) {
+			pipeline.report(std::cout);
+		}
+		IrLowering lowering(gen_options.peephole_rules);
+		asm_text = profile.time("ir-lower", [&] { return lowering.lower(module); });
+		if (peephole_report) {
+			lowering.peephole().report(std::cout);
+		}
+	} else {
+		Generator generator = profile.time("flatten", [&] { return Generator(std::move(prog.value()), gen_options); });
+		asm_text = profile.time("codegen", [&] { return generator.gen_prog(); });
+		if (peephole_report) {
+			generator.peephole().report(std::cout);
+		}
 	}
-	system("nasm -felf64 -o output/out.o output/out.asm");
-	system("ld output/out.o -o output/out");
+	profile.count("asm_bytes", asm_text.size());
 
-	std::cout << "Executing... " << std::endl;
-	system("./output/out ; echo Exit code : $?");
+	if (run_in_memory) {
+		ObjectCode obj = profile.time("assemble", [&] { return Assembler::assemble(asm_text.str()); });
+		profile.count("code_bytes", obj.text.size());
+		profile.report(std::cerr, time_passes_json);
+		std::cout << "Executing... " << std::endl;
+		const Jit::Result result = Jit::run(std::move(obj));
+		if (result.failed) {
+			return EXIT_FAILURE;
+		}
+		if (result.exited) {
+			std::cout << "Exit code : " << result.exit_code << std::endl;
+		} else {
+			std::cout << "Killed by signal " << result.signal << std::endl;
+		}
+		return EXIT_SUCCESS;
+	}
+
+	profile.time("write-asm", [&] { asm_text.write_file("output/out.asm"); });
+	if (use_nasm) {
+		profile.time("nasm", [] { system("nasm -felf64 -o output/out.o output/out.asm"); });
+		profile.time("ld", [] { system("ld output/out.o -o output/out"); });
+	} else {
+		ObjectCode obj = profile.time("assemble", [&] { return Assembler::assemble(asm_text.str()); });
+		profile.count("code_bytes", obj.text.size());
+		profile.time("write-elf", [&] { ElfWriter::write("output/out", std::move(obj)); });
+	}
+	if (cache.has_value()) {
+		profile.time("cache-store", [&] { cache->store(cache_key, asm_text, "output/out"); });
+		finish_cache();
+	}
+	profile.report(std::cerr, time_passes_json);
+
+	execute_output();
 
 	// To run the program
 	// cmake --build build/ && echo && ./build/mine ./main.me
@@ -1,6 +1,11 @@
 #pragma once
 
+#include <array>
+#include <memory_resource>
+#include <optional>
+#include <string_view>
 #include <variant>
+#include <vector>
 #include <cassert>
 
 #include "./arena.hpp"
@@ -20,6 +25,11 @@ struct NodeTermParen {
 	NodeExpr* expr;
 };
 
+struct NodeTermCall {
+	Token ident;
+	std::pmr::vector<NodeExpr*> args;
+};
+
 struct NodeBinExprAdd {
 	NodeExpr* lhs;
 	NodeExpr* rhs;
@@ -45,7 +55,7 @@ struct NodeBinExpr {
 };
 
 struct NodeTerm {
-	std::variant<NodeTermIntLit*, NodeTermIdent*, NodeTermParen*> var;
+	std::variant<NodeTermIntLit*, NodeTermIdent*, NodeTermParen*, NodeTermCall*> var;
 };
 
 struct NodeExpr {
@@ -68,7 +78,7 @@ struct NodeStmtPrint {
 struct NodeStmt;
 
 struct NodeScope {
-	std::vector<NodeStmt*> stmts;
+	std::pmr::vector<NodeStmt*> stmts;
 };
 
 struct NodeStmtIf {
@@ -90,12 +100,16 @@ struct NodeStmtAssign {
 struct NodeStmtFunction {
 	Token ident;
 	NodeScope* scope;
-	std::vector<NodeTerm*> args;
+	std::pmr::vector<NodeTerm*> args;
 };
 
 struct NodeStmtFunctionCall {
 	Token ident;
-	std::vector<NodeExpr*> args;
+	std::pmr::vector<NodeExpr*> args;
+};
+
+struct NodeStmtReturn {
+	NodeExpr* expr;
 };
 
 struct NodeStmt {
@@ -107,18 +121,43 @@ struct NodeStmt {
 	NodeStmtFor*,
 	NodeStmtAssign*,
 	NodeStmtFunction*,
-	NodeStmtFunctionCall*> var;
+	NodeStmtFunctionCall*,
+	NodeStmtReturn*> var;
 };
 
 struct NodeProg {
-	std::vector<NodeStmt*> stmts;
+	std::pmr::vector<NodeStmt*> stmts;
 };
 
 class Parser {
 public:
+	// First block of an arena the parser creates; it grows on demand.
+	static constexpr size_t default_arena_bytes = 1024 * 1024 * 4;
+
 	inline explicit Parser(std::vector<Token> tokens)
 		: m_tokens(std::move(tokens))
-		, m_allocator(1024 * 1024 * 4) // 4 mb
+		, m_own_allocator(std::in_place, default_arena_bytes)
+		, m_allocator(*m_own_allocator)
+		, m_resource(m_allocator)
+		, m_symbols(&m_resource)
+	{ }
+
+	// Streaming mode: tokens are lexed on demand as the parser consumes them.
+	inline explicit Parser(Tokenizer& tokenizer)
+		: m_tokens(tokenizer)
+		, m_own_allocator(std::in_place, default_arena_bytes)
+		, m_allocator(*m_own_allocator)
+		, m_resource(m_allocator)
+		, m_symbols(&m_resource)
+	{ }
+
+	// Builds the tree in the caller's arena, which must outlive every use of
+	// the tree. The caller may reset() it for the next compilation.
+	inline Parser(Tokenizer& tokenizer, ArenaAllocator& allocator)
+		: m_tokens(tokenizer)
+		, m_allocator(allocator)
+		, m_resource(m_allocator)
+		, m_symbols(&m_resource)
 	{ }
 
 	std::optional<NodeTerm*> parse_term() {
@@ -128,6 +167,10 @@ public:
 			auto term = m_allocator.alloc<NodeTerm>();
 			term->var = term_int_lit;
 			return term;
+		} else if (peek_is(TokenType::ident) && peek_is(TokenType::open_paren, 1)) {
+			const Token ident = consume();
+			const auto call = m_allocator.emplace<NodeTermCall>(ident, parse_call_args());
+			return m_allocator.emplace<NodeTerm>(call);
 		} else if (auto ident = try_consume(TokenType::ident)) {
 			auto expr_ident = m_allocator.alloc<NodeTermIdent>();
 			expr_ident->ident = ident.value();
@@ -161,9 +204,9 @@ public:
 		expr_lhs->var = term_lhs.value(); // 7
 
 		while (true) {
-			std::optional<Token> curr_tok = peek(); // tokentype star
+			const Token* curr_tok = peek(); // tokentype star
 			std::optional<int> prec;
-			if (curr_tok.has_value()) {
+			if (curr_tok != nullptr) {
 				prec = bin_prec(curr_tok->type); // 1
 				if (!prec.has_value() || prec.value() < min_prec) {
 					break;
@@ -180,39 +223,34 @@ public:
 						exit(EXIT_FAILURE);
 			}
 			auto expr = m_allocator.alloc<NodeBinExpr>();
-			auto expr_lhs2 = m_allocator.alloc<NodeExpr>();
 			if (op.type == TokenType::plus) {
 				auto add = m_allocator.alloc<NodeBinExprAdd>();
-				expr_lhs2->var = expr_lhs->var;
-				add->lhs = expr_lhs2;
+				add->lhs = expr_lhs;
 				add->rhs = expr_rhs.value();
 				expr->var = add;
 			}
 			else if (op.type == TokenType::star) {
 				auto multi = m_allocator.alloc<NodeBinExprMulti>();
-				expr_lhs2->var = expr_lhs->var;
-				multi->lhs = expr_lhs2;
+				multi->lhs = expr_lhs;
 				multi->rhs = expr_rhs.value();
 				expr->var = multi;
 			}
 			else if (op.type == TokenType::minus) {
 				auto sub = m_allocator.alloc<NodeBinExprMinus>();
-				expr_lhs2->var = expr_lhs->var;
-				sub->lhs = expr_lhs2;
+				sub->lhs = expr_lhs;
 				sub->rhs = expr_rhs.value();
 				expr->var = sub;
 			}
 			else if (op.type == TokenType::fslash) {
 				auto div = m_allocator.alloc<NodeBinExprDiv>();
-				expr_lhs2->var = expr_lhs->var;
-				div->lhs = expr_lhs2;
+				div->lhs = expr_lhs;
 				div->rhs = expr_rhs.value();
 				expr->var = div;
 			}
 			else {
 				assert(false);
 			}
-			expr_lhs->var = expr;
+			expr_lhs = m_allocator.emplace<NodeExpr>(expr);
 		}
 		return expr_lhs;
 	}
@@ -220,7 +258,7 @@ public:
 	std::optional<NodeScope*> parse_scope() {
 		if(!try_consume(TokenType::open_brace))
 			return {};
-		auto scope = m_allocator.alloc<NodeScope>();
+		auto scope = m_allocator.emplace<NodeScope>(std::pmr::vector<NodeStmt*>(&m_resource));
 		while (auto stmt = parse_stmt()) {
 			scope->stmts.push_back(stmt.value());
 		}
@@ -229,113 +267,143 @@ public:
 	}
 
 	std::optional<NodeStmt*> parse_stmt() {
-		if (peek().value().type == TokenType::exit && peek(1).has_value()
-			&& peek(1).value().type == TokenType::open_paren) {
-			consume();
-			consume();
-			auto stmt_exit = m_allocator.alloc<NodeStmtExit>();
-			if (auto node_expr = parse_expr()) {
-				stmt_exit->expr = node_expr.value();
-			} else {
-				std::cerr << "Invalid expression" << std::endl;
-				exit(EXIT_FAILURE);
-			}
-			try_consume(TokenType::close_paren, "Expected `)`");
-			try_consume(TokenType::semi, "Expected `;`");
-			auto stmt = m_allocator.alloc<NodeStmt>();
-			stmt->var = stmt_exit;
-			return stmt;
-		} else if (
-			peek().has_value() && peek().value().type == TokenType::let && peek(1).has_value()
-			&& peek(1).value().type == TokenType::ident && peek(2).has_value()
-			&& peek(2).value().type == TokenType::eq) {
-			consume();
-			auto stmt_let = m_allocator.alloc<NodeStmtLet>();
-			stmt_let->ident = consume();
-			consume();
-			if (auto expr = parse_expr()) {
-				stmt_let->expr = expr.value();
-			} else {
-				std::cerr << "Invalid expression" << std::endl;
-				exit(EXIT_FAILURE);
-			}
-			try_consume(TokenType::semi, "Expected `;`");
-			auto stmt = m_allocator.alloc<NodeStmt>();
-			stmt->var = stmt_let;
-			return stmt;
-		} else if (peek().value().type == TokenType::print && peek(1).has_value()
-			&& peek(1).value().type == TokenType::open_paren) {
-			consume();
-			consume();
-			auto stmt_print = m_allocator.alloc<NodeStmtPrint>();
-			if (auto node_expr = parse_expr()) {
-				stmt_print->expr = node_expr.value();
-			} else {
-				std::cerr << "Invalid expression" << std::endl;
-				exit(EXIT_FAILURE);
-			}
-			try_consume(TokenType::close_paren, "Expected `)`");
-			try_consume(TokenType::semi, "Expected `;`");
-			auto stmt = m_allocator.alloc<NodeStmt>();
-			stmt->var = stmt_print;
-			return stmt;
-		} else if (peek().value().type == TokenType::open_brace) {
-			if (auto scope = parse_scope()) {
-				auto stmt = m_allocator.alloc<NodeStmt>();
-				stmt->var = scope.value();
-				return stmt;
-			} else {
-				std::cerr << "Invalid scope" << std::endl;
-				exit(EXIT_FAILURE);
-			}
-		} else if (try_consume(TokenType::_if)) {
-			try_consume(TokenType::open_paren, "Expected `(`");
-			auto stmt_if = m_allocator.alloc<NodeStmtIf>();
-			if (auto expr = parse_expr()) {
-				stmt_if->cond = expr.value();
-			} else {
-				std::cerr << "Invalid expression" << std::endl;
-				exit(EXIT_FAILURE);
-			}
-			try_consume(TokenType::close_paren, "Expected `)`");
-			if (auto scope = parse_scope()) {
-				stmt_if->scope = scope.value();
-			} else {
-				std::cerr << "Invalid scope" << std::endl;
-				exit(EXIT_FAILURE);
-			}
-			auto stmt = m_allocator.alloc<NodeStmt>();
-			stmt->var = stmt_if;
-			return stmt;
-		} else if (try_consume(TokenType::_for)) {
-			try_consume(TokenType::open_paren, "Expected `(`");
-			auto stmt_for = m_allocator.alloc<NodeStmtFor>();
-			try_consume(TokenType::from, "Expected `from`");
-			if (auto expr = parse_expr()) {
-				stmt_for->from = expr.value();
-			} else {
-				std::cerr << "Invalid expression" << std::endl;
-				exit(EXIT_FAILURE);
-			}
-			try_consume(TokenType::to, "Expected `to`");
-			if (auto expr = parse_expr()) {
-				stmt_for->to = expr.value();
-			} else {
-				std::cerr << "Invalid expression" << std::endl;
-				exit(EXIT_FAILURE);
-			}
-			try_consume(TokenType::close_paren, "Expected `)`");
-			if (auto scope = parse_scope()) {
-				stmt_for->scope = scope.value();
-			} else {
-				std::cerr << "Invalid scope" << std::endl;
-				exit(EXIT_FAILURE);
-			}
+		const Token* tok = peek();
+		if (tok == nullptr) {
+			return {};
+		}
+		const StmtRule rule = stmt_rules[static_cast<size_t>(tok->type)];
+		if (rule == nullptr) {
+			return {};
+		}
+		return (this->*rule)();
+	}
+
+	std::optional<NodeStmt*> parse_stmt_exit() {
+		if (!peek_is(TokenType::open_paren, 1)) {
+			return {};
+		}
+		consume();
+		consume();
+		auto stmt_exit = m_allocator.alloc<NodeStmtExit>();
+		if (auto node_expr = parse_expr()) {
+			stmt_exit->expr = node_expr.value();
+		} else {
+			std::cerr << "Invalid expression" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		try_consume(TokenType::close_paren, "Expected `)`");
+		try_consume(TokenType::semi, "Expected `;`");
+		auto stmt = m_allocator.alloc<NodeStmt>();
+		stmt->var = stmt_exit;
+		return stmt;
+	}
+
+	std::optional<NodeStmt*> parse_stmt_let() {
+		if (!peek_is(TokenType::ident, 1) || !peek_is(TokenType::eq, 2)) {
+			return {};
+		}
+		consume();
+		auto stmt_let = m_allocator.alloc<NodeStmtLet>();
+		stmt_let->ident = consume();
+		consume();
+		if (auto expr = parse_expr()) {
+			stmt_let->expr = expr.value();
+		} else {
+			std::cerr << "Invalid expression" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		try_consume(TokenType::semi, "Expected `;`");
+		auto stmt = m_allocator.alloc<NodeStmt>();
+		stmt->var = stmt_let;
+		return stmt;
+	}
+
+	std::optional<NodeStmt*> parse_stmt_print() {
+		if (!peek_is(TokenType::open_paren, 1)) {
+			return {};
+		}
+		consume();
+		consume();
+		auto stmt_print = m_allocator.alloc<NodeStmtPrint>();
+		if (auto node_expr = parse_expr()) {
+			stmt_print->expr = node_expr.value();
+		} else {
+			std::cerr << "Invalid expression" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		try_consume(TokenType::close_paren, "Expected `)`");
+		try_consume(TokenType::semi, "Expected `;`");
+		auto stmt = m_allocator.alloc<NodeStmt>();
+		stmt->var = stmt_print;
+		return stmt;
+	}
+
+	std::optional<NodeStmt*> parse_stmt_scope() {
+		if (auto scope = parse_scope()) {
 			auto stmt = m_allocator.alloc<NodeStmt>();
-			stmt->var = stmt_for;
+			stmt->var = scope.value();
 			return stmt;
-		} else if (peek().has_value() && peek().value().type == TokenType::ident &&
-		peek(1).has_value() && peek(1).value().type == TokenType::eq) {
+		} else {
+			std::cerr << "Invalid scope" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	std::optional<NodeStmt*> parse_stmt_if() {
+		consume();
+		try_consume(TokenType::open_paren, "Expected `(`");
+		auto stmt_if = m_allocator.alloc<NodeStmtIf>();
+		if (auto expr = parse_expr()) {
+			stmt_if->cond = expr.value();
+		} else {
+			std::cerr << "Invalid expression" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		try_consume(TokenType::close_paren, "Expected `)`");
+		if (auto scope = parse_scope()) {
+			stmt_if->scope = scope.value();
+		} else {
+			std::cerr << "Invalid scope" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		auto stmt = m_allocator.alloc<NodeStmt>();
+		stmt->var = stmt_if;
+		return stmt;
+	}
+
+	std::optional<NodeStmt*> parse_stmt_for() {
+		consume();
+		try_consume(TokenType::open_paren, "Expected `(`");
+		auto stmt_for = m_allocator.alloc<NodeStmtFor>();
+		try_consume(TokenType::from, "Expected `from`");
+		if (auto expr = parse_expr()) {
+			stmt_for->from = expr.value();
+		} else {
+			std::cerr << "Invalid expression" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		try_consume(TokenType::to, "Expected `to`");
+		if (auto expr = parse_expr()) {
+			stmt_for->to = expr.value();
+		} else {
+			std::cerr << "Invalid expression" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		try_consume(TokenType::close_paren, "Expected `)`");
+		if (auto scope = parse_scope()) {
+			stmt_for->scope = scope.value();
+		} else {
+			std::cerr << "Invalid scope" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		auto stmt = m_allocator.alloc<NodeStmt>();
+		stmt->var = stmt_for;
+		return stmt;
+	}
+
+	// An identifier starts either an assignment or a function call.
+	std::optional<NodeStmt*> parse_stmt_ident() {
+		if (peek_is(TokenType::eq, 1)) {
 			const auto assign = m_allocator.alloc<NodeStmtAssign>();
 			assign->ident = consume();
 			consume();
@@ -349,58 +417,100 @@ public:
 			try_consume(TokenType::semi, "Expected `;`");
 			auto stmt = m_allocator.emplace<NodeStmt>(assign);
 			return stmt;
-		} else if(peek().has_value() && peek().value().type == TokenType::ident &&
-			peek(1).has_value() && peek(1).value().type == TokenType::open_paren) {
-			const auto call = m_allocator.alloc<NodeStmtFunctionCall>();
-			call->ident = consume();
-			try_consume(TokenType::open_paren, "Expected `(`");
-			while(peek().has_value() && peek().value().type != TokenType::close_paren) {
-				if (auto expr = parse_expr()) {
-					call->args.push_back(expr.value());
-				} else {
-					std::cerr << "Expected expression" << std::endl;
-					exit(EXIT_FAILURE);
-				}
-				if (peek().has_value() && peek().value().type == TokenType::comma) {
-					consume();
-				}
-			}
-			try_consume(TokenType::close_paren, "Expected `)`");
+		} else if (peek_is(TokenType::open_paren, 1)) {
+			const Token ident = consume();
+			const auto call = m_allocator.emplace<NodeStmtFunctionCall>(ident, parse_call_args());
 			try_consume(TokenType::semi, "Expected `;`");
 			auto stmt = m_allocator.emplace<NodeStmt>(call);
 			return stmt;
-		} else if (peek().has_value() && peek().value().type == TokenType::function) {
-			consume();
-			const auto func = m_allocator.alloc<NodeStmtFunction>();
-			func->ident = consume();
-			try_consume(TokenType::open_paren, "Expected `(`");
-			while(peek().has_value() && peek().value().type != TokenType::close_paren) {
-				if (auto ident = parse_term()) {
-					func->args.push_back(ident.value());
-				} else {
-					std::cerr << "Expected identifier" << std::endl;
-					exit(EXIT_FAILURE);
-				}
-				if (peek().has_value() && peek().value().type == TokenType::comma) {
-					consume();
-				}
+		} else {
+			return {};
+		}
+	}
+
+	// `(arg, ...)` after a function name.
+	std::pmr::vector<NodeExpr*> parse_call_args() {
+		std::pmr::vector<NodeExpr*> args(&m_resource);
+		try_consume(TokenType::open_paren, "Expected `(`");
+		while (peek() != nullptr && !peek_is(TokenType::close_paren)) {
+			if (auto expr = parse_expr()) {
+				args.push_back(expr.value());
+			} else {
+				std::cerr << "Expected expression" << std::endl;
+				exit(EXIT_FAILURE);
 			}
-			try_consume(TokenType::close_paren, "Expected `)`");
-			if (auto scope = parse_scope()) {
-				func->scope = scope.value();
+			try_consume(TokenType::comma);
+		}
+		try_consume(TokenType::close_paren, "Expected `)`");
+		return args;
+	}
+
+	std::optional<NodeStmt*> parse_stmt_return() {
+		if (!peek_is(TokenType::open_paren, 1)) {
+			return {};
+		}
+		consume();
+		consume();
+		auto stmt_return = m_allocator.alloc<NodeStmtReturn>();
+		if (auto node_expr = parse_expr()) {
+			stmt_return->expr = node_expr.value();
+		} else {
+			std::cerr << "Invalid expression" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		try_consume(TokenType::close_paren, "Expected `)`");
+		try_consume(TokenType::semi, "Expected `;`");
+		auto stmt = m_allocator.alloc<NodeStmt>();
+		stmt->var = stmt_return;
+		return stmt;
+	}
+
+	std::optional<NodeStmt*> parse_stmt_function() {
+		consume();
+		const auto func = m_allocator.emplace<NodeStmtFunction>(Token {}, nullptr, std::pmr::vector<NodeTerm*>(&m_resource));
+		func->ident = try_consume(TokenType::ident, "Expected identifier");
+		try_consume(TokenType::open_paren, "Expected `(`");
+		while (peek() != nullptr && !peek_is(TokenType::close_paren)) {
+			if (auto ident = parse_term()) {
+				func->args.push_back(ident.value());
 			} else {
-				std::cerr << "Invalid scope" << std::endl;
+				std::cerr << "Expected identifier" << std::endl;
+				exit(EXIT_FAILURE);
 			}
-			auto stmt = m_allocator.emplace<NodeStmt>(func);
-			return stmt;
+			try_consume(TokenType::comma);
+		}
+		try_consume(TokenType::close_paren, "Expected `)`");
+		if (auto scope = parse_scope()) {
+			func->scope = scope.value();
 		} else {
-			return {};
+			std::cerr << "Invalid scope" << std::endl;
+			exit(EXIT_FAILURE);
 		}
+		auto stmt = m_allocator.emplace<NodeStmt>(func);
+		return stmt;
+	}
+
+	[[nodiscard]] const SymbolInterner& symbols() const {
+		return m_symbols;
+	}
+
+	[[nodiscard]] size_t num_tokens() const {
+		return m_num_tokens;
+	}
+
+	[[nodiscard]] ArenaAllocator::Stats arena_stats() const {
+		return m_allocator.stats();
+	}
+
+	// Passes that add nodes to the tree allocate them here, so they live
+	// exactly as long as the nodes the parser made.
+	[[nodiscard]] ArenaAllocator& arena() {
+		return m_allocator;
 	}
 
 	std::optional<NodeProg> parse_prog() {
-		NodeProg prog;
-		while (peek().has_value()) {
+		NodeProg prog { std::pmr::vector<NodeStmt*>(&m_resource) };
+		while (peek() != nullptr) {
 			if (auto stmt = parse_stmt()) {
 				prog.stmts.push_back(stmt.value());
 			} else {
@@ -412,20 +522,44 @@ public:
 	}
 
 private:
-	[[nodiscard]] inline std::optional<Token> peek(int offset = 0) const {
-		if (m_index + offset >= m_tokens.size()) {
-			return {};
-		} else {
-			return m_tokens.at(m_index + offset);
-		}
+	using StmtRule = std::optional<NodeStmt*> (Parser::*)();
+
+	// Statement dispatch on the first token's type; rules that need more
+	// lookahead check it themselves and return nothing on mismatch.
+	static constexpr std::array<StmtRule, num_token_types> stmt_rules = [] {
+		std::array<StmtRule, num_token_types> rules {};
+		rules[static_cast<size_t>(TokenType::exit)] = &Parser::parse_stmt_exit;
+		rules[static_cast<size_t>(TokenType::let)] = &Parser::parse_stmt_let;
+		rules[static_cast<size_t>(TokenType::print)] = &Parser::parse_stmt_print;
+		rules[static_cast<size_t>(TokenType::open_brace)] = &Parser::parse_stmt_scope;
+		rules[static_cast<size_t>(TokenType::_if)] = &Parser::parse_stmt_if;
+		rules[static_cast<size_t>(TokenType::_for)] = &Parser::parse_stmt_for;
+		rules[static_cast<size_t>(TokenType::ident)] = &Parser::parse_stmt_ident;
+		rules[static_cast<size_t>(TokenType::function)] = &Parser::parse_stmt_function;
+		rules[static_cast<size_t>(TokenType::_return)] = &Parser::parse_stmt_return;
+		return rules;
+	}();
+
+	[[nodiscard]] inline const Token* peek(int offset = 0) {
+		return m_tokens.peek(offset);
+	}
+
+	[[nodiscard]] inline bool peek_is(TokenType type, int offset = 0) {
+		const Token* tok = peek(offset);
+		return tok != nullptr && tok->type == type;
 	}
 
 	inline Token consume() {
-		return m_tokens.at(m_index++);
+		m_num_tokens++;
+		Token token = m_tokens.consume();
+		if (token.type == TokenType::ident) {
+			token.symbol = m_symbols.intern(token.value.value());
+		}
+		return token;
 	}
 
-	inline Token try_consume(TokenType type, const std::string& err_msg) {
-		if (peek().has_value() && peek().value().type == type) {
+	inline Token try_consume(TokenType type, const std::string_view err_msg) {
+		if (peek_is(type)) {
 			return consume();
 		} else {
 			std::cerr << err_msg << std::endl;
@@ -435,14 +569,20 @@ private:
 
 	inline std::optional<Token> try_consume(TokenType type)
 	{
-		if (peek().has_value() && peek().value().type == type) {
+		if (peek_is(type)) {
 			return consume();
 		} else {
 			return {};
 		}
 	}
 
-	const std::vector<Token> m_tokens;
-	size_t m_index = 0;
-	ArenaAllocator m_allocator;
+	TokenStream m_tokens;
+	size_t m_num_tokens = 0;
+	// Empty when the arena was passed in.
+	std::optional<ArenaAllocator> m_own_allocator;
+	ArenaAllocator& m_allocator;
+	// Backs the std::pmr containers inside AST nodes, so they live in the
+	// arena with their nodes instead of leaking heap blocks.
+	ArenaResource m_resource;
+	SymbolInterner m_symbols;
 };
\ No newline at end of file
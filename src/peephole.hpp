@@ -0,0 +1,179 @@
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <iomanip>
+#include <ostream>
+#include <string_view>
+#include <vector>
+
+#include "./instructions.hpp"
+
+namespace peephole_detail {
+
+inline bool is_mem(const std::string_view operand) {
+	return operand.find('[') != std::string_view::npos;
+}
+
+// "QWORD [rsp + 8]" and "[rsp + 8]" name the same slot.
+inline std::string_view strip_size(std::string_view operand) {
+	for (const std::string_view size : { "BYTE ", "WORD ", "DWORD ", "QWORD " }) {
+		if (operand.starts_with(size)) {
+			operand.remove_prefix(size.size());
+			break;
+		}
+	}
+	return operand;
+}
+
+// push X / pop X
+inline size_t push_pop_same(std::vector<Instr>& out) {
+	if (out.size() < 2) {
+		return 0;
+	}
+	const Instr& push = out[out.size() - 2];
+	const Instr& pop = out.back();
+	if (!push.is("push") || !pop.is("pop") || push.dst != pop.dst) {
+		return 0;
+	}
+	out.resize(out.size() - 2);
+	return 2;
+}
+
+// push X / pop reg -> mov reg, X
+inline size_t push_pop_move(std::vector<Instr>& out) {
+	if (out.size() < 2) {
+		return 0;
+	}
+	Instr& push = out[out.size() - 2];
+	const Instr& pop = out.back();
+	if (!push.is("push") || !pop.is("pop") || is_mem(pop.dst)) {
+		return 0;
+	}
+	push = Instr { Instr::Kind::op, "mov", pop.dst, std::move(push.dst) };
+	out.pop_back();
+	return 1;
+}
+
+// add rsp, 0 / sub rsp, 0
+inline size_t zero_stack_adjust(std::vector<Instr>& out) {
+	if (out.empty()) {
+		return 0;
+	}
+	const Instr& adjust = out.back();
+	if ((!adjust.is("add") && !adjust.is("sub")) || adjust.dst != "rsp" || adjust.src != "0") {
+		return 0;
+	}
+	out.pop_back();
+	return 1;
+}
+
+// mov reg, reg
+inline size_t self_move(std::vector<Instr>& out) {
+	if (out.empty() || !out.back().is("mov") || out.back().dst != out.back().src) {
+		return 0;
+	}
+	out.pop_back();
+	return 1;
+}
+
+// mov reg, [slot] / mov [slot], reg: the store writes back what is there.
+inline size_t store_after_load(std::vector<Instr>& out) {
+	if (out.size() < 2) {
+		return 0;
+	}
+	const Instr& load = out[out.size() - 2];
+	const Instr& store = out.back();
+	if (!load.is("mov") || !store.is("mov") || !is_mem(load.src) || load.dst != store.src
+		|| strip_size(load.src) != strip_size(store.dst)) {
+		return 0;
+	}
+	out.pop_back();
+	return 1;
+}
+
+} // namespace peephole_detail
+
+struct PeepholeRule {
+	std::string_view name;
+	// Tries to rewrite the instructions at the end of `out` and returns how
+	// many it removed, or 0 when the rule does not apply.
+	size_t (*apply)(std::vector<Instr>& out);
+};
+
+inline constexpr std::array<PeepholeRule, 5> peephole_rules {
+	PeepholeRule { "push-pop-same", peephole_detail::push_pop_same },
+	PeepholeRule { "push-pop-move", peephole_detail::push_pop_move },
+	PeepholeRule { "zero-stack-adjust", peephole_detail::zero_stack_adjust },
+	PeepholeRule { "self-move", peephole_detail::self_move },
+	PeepholeRule { "store-after-load", peephole_detail::store_after_load },
+};
+
+using PeepholeRuleSet = std::bitset<peephole_rules.size()>;
+
+// Returns the index of the rule called `name` in peephole_rules, or
+// peephole_rules.size() when there is none.
+[[nodiscard]] inline size_t find_peephole_rule(const std::string_view name) {
+	size_t i = 0;
+	while (i < peephole_rules.size() && peephole_rules[i].name != name) {
+		i++;
+	}
+	return i;
+}
+
+// Rewrites an instruction list with the enabled rules. Instructions are
+// moved to the output one at a time and the rules are retried on the tail
+// until none applies, so a rewrite can expose the next one (a push/pop
+// turned into a mov that is then a self-move). Labels are never matched,
+// so nothing is combined across a jump target.
+class Peephole {
+public:
+	explicit Peephole(const PeepholeRuleSet enabled = PeepholeRuleSet().set())
+		: m_enabled(enabled)
+	{
+	}
+
+	void run(std::vector<Instr>& instrs) {
+		if (m_enabled.none()) {
+			return;
+		}
+		std::vector<Instr> out;
+		out.reserve(instrs.size());
+		for (Instr& instr : instrs) {
+			out.push_back(std::move(instr));
+			bool changed = true;
+			while (changed) {
+				changed = false;
+				for (size_t i = 0; i < peephole_rules.size(); i++) {
+					if (!m_enabled.test(i)) {
+						continue;
+					}
+					if (const size_t removed = peephole_rules[i].apply(out)) {
+						m_removed[i] += removed;
+						changed = true;
+						break;
+					}
+				}
+			}
+		}
+		instrs = std::move(out);
+	}
+
+	[[nodiscard]] const std::array<size_t, peephole_rules.size()>& removed() const {
+		return m_removed;
+	}
+
+	void report(std::ostream& out) const {
+		size_t total = 0;
+		for (size_t i = 0; i < peephole_rules.size(); i++) {
+			out << std::left << std::setw(20) << peephole_rules[i].name << std::right << std::setw(8) << m_removed[i]
+				<< (m_enabled.test(i) ? "" : "  (disabled)") << std::endl;
+			total += m_removed[i];
+		}
+		out << std::left << std::setw(20) << "total" << std::right << std::setw(8) << total << std::endl;
+	}
+
+private:
+	PeepholeRuleSet m_enabled;
+	std::array<size_t, peephole_rules.size()> m_removed {};
+};
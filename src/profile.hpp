@@ -0,0 +1,211 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "./parser.hpp"
+
+// Wall and CPU time of each compiler phase, plus named size counters, for
+// --time-passes. A disabled profiler still runs the phases, it just does
+// not read the clocks.
+class PassProfiler {
+public:
+	explicit PassProfiler(const bool enabled)
+		: m_enabled(enabled)
+	{
+	}
+
+	// Runs `phase` and returns what it returns.
+	template <typename F>
+	decltype(auto) time(const std::string_view name, F&& phase) {
+		const Timer timer(*this, name);
+		return phase();
+	}
+
+	void count(const std::string_view name, const uint64_t value) {
+		if (m_enabled) {
+			m_counters.push_back(Counter { std::string(name), value });
+		}
+	}
+
+	[[nodiscard]] bool enabled() const {
+		return m_enabled;
+	}
+
+	void report(std::ostream& out, const bool json) const {
+		if (!m_enabled) {
+			return;
+		}
+		double total_wall = 0;
+		double total_cpu = 0;
+		for (const Phase& phase : m_phases) {
+			total_wall += phase.wall_ms;
+			total_cpu += phase.cpu_ms;
+		}
+		const uint64_t peak_rss = peak_rss_bytes();
+		if (json) {
+			out << "{\"phases\": [";
+			for (size_t i = 0; i < m_phases.size(); i++) {
+				out << (i == 0 ? "" : ", ") << "{\"name\": \"" << m_phases[i].name << "\", \"wall_ms\": " << m_phases[i].wall_ms
+					<< ", \"cpu_ms\": " << m_phases[i].cpu_ms << "}";
+			}
+			out << "], \"total_wall_ms\": " << total_wall << ", \"total_cpu_ms\": " << total_cpu;
+			for (const Counter& counter : m_counters) {
+				out << ", \"" << counter.name << "\": " << counter.value;
+			}
+			out << ", \"peak_rss_bytes\": " << peak_rss << "}" << std::endl;
+			return;
+		}
+		out << std::left << std::setw(14) << "phase" << std::right << std::setw(12) << "wall ms" << std::setw(12) << "cpu ms"
+			<< std::setw(8) << "wall%" << std::endl;
+		out << std::fixed << std::setprecision(3);
+		for (const Phase& phase : m_phases) {
+			out << std::left << std::setw(14) << phase.name << std::right << std::setw(12) << phase.wall_ms << std::setw(12)
+				<< phase.cpu_ms << std::setprecision(1) << std::setw(7) << (total_wall > 0 ? 100.0 * phase.wall_ms / total_wall : 0.0)
+				<< "%" << std::setprecision(3) << std::endl;
+		}
+		out << std::left << std::setw(14) << "total" << std::right << std::setw(12) << total_wall << std::setw(12) << total_cpu << std::endl;
+		for (const Counter& counter : m_counters) {
+			out << std::left << std::setw(20) << counter.name << std::right << std::setw(14) << counter.value << std::endl;
+		}
+		out << std::left << std::setw(20) << "peak_rss_bytes" << std::right << std::setw(14) << peak_rss << std::endl;
+		out.unsetf(std::ios::floatfield);
+	}
+
+private:
+	struct Phase {
+		std::string name;
+		double wall_ms;
+		double cpu_ms;
+	};
+
+	struct Counter {
+		std::string name;
+		uint64_t value;
+	};
+
+	// Records one phase when it goes out of scope, however the phase
+	// returns.
+	class Timer {
+	public:
+		Timer(PassProfiler& profiler, const std::string_view name)
+			: m_profiler(profiler)
+			, m_name(name)
+		{
+			if (m_profiler.m_enabled) {
+				m_wall = std::chrono::steady_clock::now();
+				m_cpu = cpu_ms();
+			}
+		}
+
+		~Timer() {
+			if (m_profiler.m_enabled) {
+				const double wall = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_wall).count();
+				m_profiler.m_phases.push_back(Phase { std::string(m_name), wall, cpu_ms() - m_cpu });
+			}
+		}
+
+	private:
+		PassProfiler& m_profiler;
+		std::string_view m_name;
+		std::chrono::steady_clock::time_point m_wall {};
+		double m_cpu = 0;
+	};
+
+	// This process's CPU time plus that of the children it has waited for,
+	// so phases that run nasm and ld through system() are charged for them.
+	[[nodiscard]] static double cpu_ms() {
+		timespec ts {};
+		clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+		rusage children {};
+		getrusage(RUSAGE_CHILDREN, &children);
+		return static_cast<double>(ts.tv_sec) * 1e3 + static_cast<double>(ts.tv_nsec) / 1e6
+			+ timeval_ms(children.ru_utime) + timeval_ms(children.ru_stime);
+	}
+
+	[[nodiscard]] static double timeval_ms(const timeval& tv) {
+		return static_cast<double>(tv.tv_sec) * 1e3 + static_cast<double>(tv.tv_usec) / 1e3;
+	}
+
+	[[nodiscard]] static uint64_t peak_rss_bytes() {
+		rusage usage {};
+		getrusage(RUSAGE_SELF, &usage);
+		return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+	}
+
+	const bool m_enabled;
+	std::vector<Phase> m_phases {};
+	std::vector<Counter> m_counters {};
+};
+
+// Statements, expression nodes and terms in the tree, call arguments
+// included.
+[[nodiscard]] inline size_t count_ast_nodes(const NodeExpr* expr) {
+	if (const auto* bin_expr = std::get_if<NodeBinExpr*>(&expr->var)) {
+		return std::visit([](const auto* op) { return 1 + count_ast_nodes(op->lhs) + count_ast_nodes(op->rhs); }, (*bin_expr)->var);
+	}
+	const NodeTerm* term = std::get<NodeTerm*>(expr->var);
+	if (const auto* paren = std::get_if<NodeTermParen*>(&term->var)) {
+		return 1 + count_ast_nodes((*paren)->expr);
+	}
+	size_t count = 1;
+	if (const auto* call = std::get_if<NodeTermCall*>(&term->var)) {
+		for (const NodeExpr* arg : (*call)->args) {
+			count += count_ast_nodes(arg);
+		}
+	}
+	return count;
+}
+
+[[nodiscard]] inline size_t count_ast_nodes(const std::pmr::vector<NodeStmt*>& stmts) {
+	struct StmtVisitor {
+		size_t operator()(const NodeStmtExit* stmt_exit) const {
+			return count_ast_nodes(stmt_exit->expr);
+		}
+		size_t operator()(const NodeStmtLet* stmt_let) const {
+			return count_ast_nodes(stmt_let->expr);
+		}
+		size_t operator()(const NodeStmtPrint* stmt_print) const {
+			return count_ast_nodes(stmt_print->expr);
+		}
+		size_t operator()(const NodeScope* scope) const {
+			return count_ast_nodes(scope->stmts);
+		}
+		size_t operator()(const NodeStmtIf* stmt_if) const {
+			return count_ast_nodes(stmt_if->cond) + count_ast_nodes(stmt_if->scope->stmts);
+		}
+		size_t operator()(const NodeStmtFor* stmt_for) const {
+			return count_ast_nodes(stmt_for->from) + count_ast_nodes(stmt_for->to) + count_ast_nodes(stmt_for->scope->stmts);
+		}
+		size_t operator()(const NodeStmtAssign* stmt_assign) const {
+			return count_ast_nodes(stmt_assign->expr);
+		}
+		size_t operator()(const NodeStmtFunction* stmt_function) const {
+			return stmt_function->args.size() + count_ast_nodes(stmt_function->scope->stmts);
+		}
+		size_t operator()(const NodeStmtFunctionCall* stmt_call) const {
+			size_t count = 0;
+			for (const NodeExpr* arg : stmt_call->args) {
+				count += count_ast_nodes(arg);
+			}
+			return count;
+		}
+		size_t operator()(const NodeStmtReturn* stmt_return) const {
+			return count_ast_nodes(stmt_return->expr);
+		}
+	};
+	size_t count = 0;
+	for (const NodeStmt* stmt : stmts) {
+		count += 1 + std::visit(StmtVisitor {}, stmt->var);
+	}
+	return count;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <string_view>
+
+// Support routines appended to every generated program. print goes through
+// one shared output buffer instead of a write syscall and a .data message
+// per call site; the buffer is flushed when the next number would not fit
+// and by mine_exit, which every exit path of the program goes through.
+//
+// mine_print_int writes rdi as a signed decimal followed by a newline.
+// mine_exit flushes and exits with status rdi. Both clobber only rax, rcx,
+// rdx, rsi, rdi and r11, which are never live across a statement.
+inline constexpr std::string_view runtime_asm = R"(
+mine_print_int:
+	mov rax, rdi
+	test rax, rax
+	jns .digits
+	neg rax
+.digits:
+	lea rsi, [mine_digits + 23]
+	mov BYTE [rsi], 0xA
+	mov rcx, 10
+.digit:
+	xor edx, edx
+	div rcx
+	add dl, '0'
+	dec rsi
+	mov [rsi], dl
+	test rax, rax
+	jnz .digit
+	test rdi, rdi
+	jns .append
+	dec rsi
+	mov BYTE [rsi], '-'
+.append:
+	lea rcx, [mine_digits + 24]
+	sub rcx, rsi
+	mov rax, [mine_out_len]
+	lea rdx, [rax + rcx]
+	cmp rdx, mine_out_cap
+	jbe .copy
+	push rcx
+	push rsi
+	call mine_flush
+	pop rsi
+	pop rcx
+	xor eax, eax
+	mov rdx, rcx
+.copy:
+	mov [mine_out_len], rdx
+	lea rdi, [rax + mine_out_buf]
+.copy_byte:
+	mov dl, [rsi]
+	mov [rdi], dl
+	inc rsi
+	inc rdi
+	dec rcx
+	jnz .copy_byte
+	ret
+
+mine_flush:
+	mov rdx, [mine_out_len]
+	test rdx, rdx
+	jz .done
+	mov rax, 1 ; sys_write
+	mov rdi, 1 ; stdout
+	mov rsi, mine_out_buf
+	syscall
+	mov QWORD [mine_out_len], 0
+.done:
+	ret
+
+mine_exit:
+	push rdi
+	call mine_flush
+	pop rdi
+	mov rax, 60
+	syscall
+
+section .bss
+	mine_out_cap equ 4096
+	mine_out_buf resb mine_out_cap
+	mine_out_len resq 1
+	mine_digits resb 24
+)";
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Character classes shared by the tokenizer and the run-scanning kernels.
+enum class CharClass : uint8_t {
+	invalid,
+	space,
+	alpha,
+	digit,
+	punct
+};
+
+inline constexpr std::array<CharClass, 256> char_classes = [] {
+	std::array<CharClass, 256> table {};
+	for (int c = 'a'; c <= 'z'; c++) {
+		table[c] = CharClass::alpha;
+	}
+	for (int c = 'A'; c <= 'Z'; c++) {
+		table[c] = CharClass::alpha;
+	}
+	for (int c = '0'; c <= '9'; c++) {
+		table[c] = CharClass::digit;
+	}
+	for (const char c : std::string_view(" \t\n\v\f\r")) {
+		table[static_cast<unsigned char>(c)] = CharClass::space;
+	}
+	for (const char c : std::string_view("(){};+-*/=,")) {
+		table[static_cast<unsigned char>(c)] = CharClass::punct;
+	}
+	return table;
+}();
+
+[[nodiscard]] inline constexpr CharClass char_class(const char c) {
+	return char_classes[static_cast<unsigned char>(c)];
+}
+
+[[nodiscard]] inline constexpr bool is_ident_char(const char c) {
+	const CharClass cls = char_class(c);
+	return cls == CharClass::alpha || cls == CharClass::digit;
+}
+
+// Run scanners: each takes the source and a start index and returns the index
+// of the first byte past the run of whitespace / identifier / digit bytes.
+using ScanFn = size_t (*)(const char* src, size_t index, size_t size);
+
+struct Scanner {
+	ScanFn skip_space;
+	ScanFn skip_ident;
+	ScanFn skip_digits;
+};
+
+enum class ScanKernel {
+	scalar,
+	sse2,
+	avx2
+};
+
+namespace scan_detail {
+
+inline size_t skip_space_scalar(const char* src, size_t index, const size_t size) {
+	while (index < size && char_class(src[index]) == CharClass::space) {
+		index++;
+	}
+	return index;
+}
+
+inline size_t skip_ident_scalar(const char* src, size_t index, const size_t size) {
+	while (index < size && is_ident_char(src[index])) {
+		index++;
+	}
+	return index;
+}
+
+inline size_t skip_digits_scalar(const char* src, size_t index, const size_t size) {
+	while (index < size && char_class(src[index]) == CharClass::digit) {
+		index++;
+	}
+	return index;
+}
+
+#if defined(__x86_64__)
+
+// Unsigned byte range test lo <= c <= hi, done with a signed compare after
+// biasing both sides by -128.
+inline __m128i in_range_sse2(const __m128i v, const char lo, const char hi) {
+	const __m128i shifted = _mm_sub_epi8(v, _mm_set1_epi8(static_cast<char>(lo + 128)));
+	return _mm_cmplt_epi8(shifted, _mm_set1_epi8(static_cast<char>(hi - lo + 1 - 128)));
+}
+
+inline __m128i space_mask_sse2(const __m128i v) {
+	return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), in_range_sse2(v, '\t', '\r'));
+}
+
+inline __m128i digit_mask_sse2(const __m128i v) {
+	return in_range_sse2(v, '0', '9');
+}
+
+inline __m128i ident_mask_sse2(const __m128i v) {
+	const __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+	return _mm_or_si128(in_range_sse2(lower, 'a', 'z'), in_range_sse2(v, '0', '9'));
+}
+
+template <__m128i (*Mask)(__m128i), ScanFn Tail>
+inline size_t skip_sse2(const char* src, size_t index, const size_t size) {
+	// Most runs end after a byte or two; settle those without a vector load.
+	if (Tail(src, index, std::min(index + 1, size)) == index) {
+		return index;
+	}
+	while (index + 16 <= size) {
+		const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + index));
+		const unsigned outside = ~static_cast<unsigned>(_mm_movemask_epi8(Mask(v))) & 0xFFFFu;
+		if (outside != 0) {
+			return index + static_cast<size_t>(__builtin_ctz(outside));
+		}
+		index += 16;
+	}
+	return Tail(src, index, size);
+}
+
+__attribute__((target("avx2"))) inline __m256i in_range_avx2(const __m256i v, const char lo, const char hi) {
+	const __m256i shifted = _mm256_sub_epi8(v, _mm256_set1_epi8(static_cast<char>(lo + 128)));
+	return _mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(hi - lo + 1 - 128)), shifted);
+}
+
+__attribute__((target("avx2"))) inline __m256i space_mask_avx2(const __m256i v) {
+	return _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), in_range_avx2(v, '\t', '\r'));
+}
+
+__attribute__((target("avx2"))) inline __m256i digit_mask_avx2(const __m256i v) {
+	return in_range_avx2(v, '0', '9');
+}
+
+__attribute__((target("avx2"))) inline __m256i ident_mask_avx2(const __m256i v) {
+	const __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+	return _mm256_or_si256(in_range_avx2(lower, 'a', 'z'), in_range_avx2(v, '0', '9'));
+}
+
+template <__m256i (*Mask)(__m256i), ScanFn Tail>
+__attribute__((target("avx2"))) inline size_t skip_avx2(const char* src, size_t index, const size_t size) {
+	// Most runs end after a byte or two; settle those without a vector load.
+	if (Tail(src, index, std::min(index + 1, size)) == index) {
+		return index;
+	}
+	while (index + 32 <= size) {
+		const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + index));
+		const uint32_t outside = ~static_cast<uint32_t>(_mm256_movemask_epi8(Mask(v)));
+		if (outside != 0) {
+			return index + static_cast<size_t>(__builtin_ctz(outside));
+		}
+		index += 32;
+	}
+	return Tail(src, index, size);
+}
+
+#endif
+
+} // namespace scan_detail
+
+[[nodiscard]] inline ScanKernel detect_scan_kernel() {
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("avx2")) {
+		return ScanKernel::avx2;
+	}
+	return ScanKernel::sse2;
+#else
+	return ScanKernel::scalar;
+#endif
+}
+
+[[nodiscard]] inline const Scanner& scanner_for(const ScanKernel kernel) {
+	using namespace scan_detail;
+	static constexpr Scanner scalar { skip_space_scalar, skip_ident_scalar, skip_digits_scalar };
+#if defined(__x86_64__)
+	// Short runs are the common case, so the SIMD kernels finish with the
+	// scalar loop rather than a masked load.
+	static constexpr Scanner sse2 {
+		skip_sse2<space_mask_sse2, skip_space_scalar>,
+		skip_sse2<ident_mask_sse2, skip_ident_scalar>,
+		skip_sse2<digit_mask_sse2, skip_digits_scalar>
+	};
+	static constexpr Scanner avx2 {
+		skip_avx2<space_mask_avx2, skip_space_scalar>,
+		skip_avx2<ident_mask_avx2, skip_ident_scalar>,
+		skip_avx2<digit_mask_avx2, skip_digits_scalar>
+	};
+	switch (kernel) {
+	case ScanKernel::avx2:
+		return avx2;
+	case ScanKernel::sse2:
+		return sse2;
+	case ScanKernel::scalar:
+		break;
+	}
+#endif
+	return scalar;
+}
+
+[[nodiscard]] inline const char* scan_kernel_name(const ScanKernel kernel) {
+	switch (kernel) {
+	case ScanKernel::avx2:
+		return "avx2";
+	case ScanKernel::sse2:
+		return "sse2";
+	case ScanKernel::scalar:
+		return "scalar";
+	}
+	return "scalar";
+}
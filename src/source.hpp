@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <iostream>
+#include <string_view>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only view over the bytes of an input file. The file is mapped when
+// possible; pipes and other unmappable inputs are read into a heap buffer.
+// Tokens keep std::string_view slices into this buffer, so it must outlive
+// every Tokenizer, Parser and Generator built from it.
+class SourceFile {
+public:
+	inline explicit SourceFile(const char* path) {
+		const int fd = ::open(path, O_RDONLY);
+		if (fd < 0) {
+			std::cerr << "Unable to open " << path << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		struct stat st {};
+		if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+			void* mapped = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			if (mapped != MAP_FAILED) {
+				::madvise(mapped, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+				m_data = static_cast<const char*>(mapped);
+				m_size = static_cast<size_t>(st.st_size);
+				m_mapped = true;
+				::close(fd);
+				return;
+			}
+		}
+		read_all(fd);
+		::close(fd);
+	}
+
+	SourceFile(const SourceFile&) = delete;
+	SourceFile& operator=(const SourceFile&) = delete;
+
+	SourceFile(SourceFile&& other) noexcept
+		: m_data { std::exchange(other.m_data, nullptr) }
+		, m_size { std::exchange(other.m_size, 0) }
+		, m_mapped { std::exchange(other.m_mapped, false) }
+	{
+	}
+
+	SourceFile& operator=(SourceFile&& other) noexcept
+	{
+		std::swap(m_data, other.m_data);
+		std::swap(m_size, other.m_size);
+		std::swap(m_mapped, other.m_mapped);
+		return *this;
+	}
+
+	[[nodiscard]] inline std::string_view view() const {
+		return { m_data == nullptr ? "" : m_data, m_size };
+	}
+
+	[[nodiscard]] inline bool is_mapped() const {
+		return m_mapped;
+	}
+
+	~SourceFile()
+	{
+		if (m_mapped) {
+			::munmap(const_cast<char*>(m_data), m_size);
+		} else {
+			delete[] m_data;
+		}
+	}
+
+private:
+	inline void read_all(const int fd) {
+		size_t capacity = 64 * 1024;
+		char* buffer = new char[capacity];
+		size_t size = 0;
+		while (true) {
+			if (size == capacity) {
+				char* grown = new char[capacity * 2];
+				std::copy(buffer, buffer + size, grown);
+				delete[] buffer;
+				buffer = grown;
+				capacity *= 2;
+			}
+			const ssize_t n = ::read(fd, buffer + size, capacity - size);
+			if (n < 0) {
+				std::cerr << "Unable to read input" << std::endl;
+				delete[] buffer;
+				exit(EXIT_FAILURE);
+			}
+			if (n == 0) {
+				break;
+			}
+			size += static_cast<size_t>(n);
+		}
+		m_data = buffer;
+		m_size = size;
+	}
+
+	const char* m_data = nullptr;
+	size_t m_size = 0;
+	bool m_mapped = false;
+};
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <string>
+
+#include "./instructions.hpp"
+
+// Multiply-high reciprocal for unsigned 64-bit division by a constant d
+// that is not a power of two (Granlund and Montgomery, "Division by
+// Invariant Integers using Multiplication").
+//
+// When a 64-bit m with m * d in [2^(64+s), 2^(64+s) + 2^s] exists,
+// n / d == mulhi(m, n) >> s. Otherwise m is the low 64 bits of the 65-bit
+// reciprocal and the quotient is (t + ((n - t) >> 1)) >> (s - 1) with
+// t = mulhi(m, n), which keeps every intermediate in 64 bits.
+struct DivMagic {
+	uint64_t multiplier;
+	int shift;
+	bool add_fixup;
+};
+
+[[nodiscard]] inline DivMagic div_magic(const uint64_t d) {
+	using u128 = unsigned __int128;
+	for (int s = 0; s < 64; s++) {
+		const u128 p = u128 { 1 } << (64 + s);
+		const u128 m = p / d + 1;
+		if (m >> 64 != 0) {
+			break;
+		}
+		if (m * d - p <= u128 { 1 } << s) {
+			return { static_cast<uint64_t>(m), s, false };
+		}
+	}
+	const int l = 64 - std::countl_zero(d - 1);
+	const u128 m = (((u128 { 1 } << l) - d) << 64) / d + 1;
+	return { static_cast<uint64_t>(m), l, true };
+}
+
+// dst = dst * c without loading c into a register: shifts for powers of
+// two, lea for 3, 5 and 9 (optionally followed by a shift), imul with an
+// immediate otherwise. rax is used only for constants wider than 32 bits.
+inline void emit_mul_const(InstrList& out, const std::string& dst, const int64_t c) {
+	const auto u = static_cast<uint64_t>(c);
+	if (u == 0) {
+		out.emit("mov", dst, "0");
+		return;
+	}
+	if (std::has_single_bit(u)) {
+		if (u > 1) {
+			out.emit("shl", dst, std::to_string(std::countr_zero(u)));
+		}
+		return;
+	}
+	for (const uint64_t factor : std::array<uint64_t, 3> { 9, 5, 3 }) {
+		if (u % factor == 0 && std::has_single_bit(u / factor)) {
+			out.emit("lea", dst, "[" + dst + " + " + dst + "*" + std::to_string(factor - 1) + "]");
+			if (u / factor > 1) {
+				out.emit("shl", dst, std::to_string(std::countr_zero(u / factor)));
+			}
+			return;
+		}
+	}
+	if (c >= INT32_MIN && c <= INT32_MAX) {
+		// Three-operand form; the Instr model only has two operand slots.
+		out.emit("imul", dst, dst + ", " + std::to_string(c));
+	} else {
+		out.emit("mov", "rax", std::to_string(c));
+		out.emit("imul", dst, "rax");
+	}
+}
+
+// dst = dst / d, unsigned, for d != 0. Clobbers rax and rdx.
+inline void emit_div_const(InstrList& out, const std::string& dst, const uint64_t d) {
+	if (std::has_single_bit(d)) {
+		if (d > 1) {
+			out.emit("shr", dst, std::to_string(std::countr_zero(d)));
+		}
+		return;
+	}
+	const DivMagic magic = div_magic(d);
+	out.emit("mov", "rax", std::to_string(static_cast<int64_t>(magic.multiplier)));
+	out.emit("mul", dst);
+	if (magic.add_fixup) {
+		out.emit("sub", dst, "rdx");
+		out.emit("shr", dst, "1");
+		out.emit("add", dst, "rdx");
+		if (magic.shift > 1) {
+			out.emit("shr", dst, std::to_string(magic.shift - 1));
+		}
+		return;
+	}
+	if (magic.shift > 0) {
+		out.emit("shr", "rdx", std::to_string(magic.shift));
+	}
+	out.emit("mov", dst, "rdx");
+}
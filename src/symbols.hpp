@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <memory_resource>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using SymbolId = uint32_t;
+
+inline constexpr SymbolId no_symbol = std::numeric_limits<SymbolId>::max();
+
+// Maps every distinct identifier spelling to a dense SymbolId. The names
+// are views into the source buffer, so interning never copies text.
+class SymbolInterner {
+public:
+	explicit SymbolInterner(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+		: m_ids(resource)
+		, m_names(resource)
+	{
+	}
+
+	SymbolId intern(const std::string_view name) {
+		const auto [it, inserted] = m_ids.try_emplace(name, static_cast<SymbolId>(m_names.size()));
+		if (inserted) {
+			m_names.push_back(name);
+		}
+		return it->second;
+	}
+
+	[[nodiscard]] std::string_view name(const SymbolId id) const {
+		return m_names[id];
+	}
+
+	[[nodiscard]] size_t size() const {
+		return m_names.size();
+	}
+
+private:
+	std::pmr::unordered_map<std::string_view, SymbolId> m_ids;
+	std::pmr::vector<std::string_view> m_names;
+};
+
+// Symbol-indexed table of the bindings currently in scope. Because ids are
+// dense, a lookup is a single array index; begin_scope/end_scope unbind
+// everything bound since the matching begin_scope.
+template <typename T>
+class ScopedSymbolTable {
+public:
+	[[nodiscard]] const T* find(const SymbolId symbol) const {
+		if (symbol >= m_slots.size() || m_slots[symbol] == no_slot) {
+			return nullptr;
+		}
+		return &m_entries[m_slots[symbol]].value;
+	}
+
+	[[nodiscard]] T* find(const SymbolId symbol) {
+		return const_cast<T*>(std::as_const(*this).find(symbol));
+	}
+
+	// `symbol` must come from the interner; no_symbol would wrap the resize.
+	void bind(const SymbolId symbol, T value) {
+		assert(symbol != no_symbol);
+		if (symbol >= m_slots.size()) {
+			m_slots.resize(symbol + 1, no_slot);
+		}
+		m_entries.push_back(Entry { symbol, m_slots[symbol], std::move(value) });
+		m_slots[symbol] = static_cast<uint32_t>(m_entries.size() - 1);
+	}
+
+	void begin_scope() {
+		m_scopes.push_back(m_entries.size());
+	}
+
+	// Returns how many bindings the closing scope dropped.
+	size_t end_scope() {
+		const size_t pop_count = m_entries.size() - m_scopes.back();
+		for (size_t i = 0; i < pop_count; i++) {
+			const Entry& entry = m_entries.back();
+			m_slots[entry.symbol] = entry.shadowed;
+			m_entries.pop_back();
+		}
+		m_scopes.pop_back();
+		return pop_count;
+	}
+
+	[[nodiscard]] size_t size() const {
+		return m_entries.size();
+	}
+
+private:
+	static constexpr uint32_t no_slot = std::numeric_limits<uint32_t>::max();
+
+	struct Entry {
+		SymbolId symbol;
+		uint32_t shadowed;
+		T value;
+	};
+
+	std::vector<uint32_t> m_slots {};
+	std::vector<Entry> m_entries {};
+	std::vector<size_t> m_scopes {};
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Runs job(0) .. job(num_jobs - 1) on up to num_threads threads, the calling
+// thread included; 0 threads means one per core. Jobs are dealt round-robin
+// into one deque per thread. A thread takes from the back of its own deque
+// and, once that is empty, steals from the front of the others', so a few
+// long jobs do not leave the rest of the threads idle. No job adds work, so
+// a thread is done when one pass over every deque finds nothing.
+class WorkStealingPool {
+public:
+	template <typename Job>
+	static void run(const size_t num_jobs, size_t num_threads, Job&& job) {
+		if (num_threads == 0) {
+			num_threads = std::max(1u, std::thread::hardware_concurrency());
+		}
+		num_threads = std::min(num_threads, num_jobs);
+		if (num_threads <= 1) {
+			for (size_t i = 0; i < num_jobs; i++) {
+				job(i);
+			}
+			return;
+		}
+
+		std::vector<Queue> queues(num_threads);
+		for (size_t i = 0; i < num_jobs; i++) {
+			queues[i % num_threads].jobs.push_back(i);
+		}
+		const auto work = [&](const size_t self) {
+			while (const std::optional<size_t> i = take(queues, self)) {
+				job(*i);
+			}
+		};
+		std::vector<std::jthread> threads;
+		threads.reserve(num_threads - 1);
+		for (size_t t = 1; t < num_threads; t++) {
+			threads.emplace_back(work, t);
+		}
+		work(0);
+	}
+
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<size_t> jobs;
+	};
+
+	[[nodiscard]] static std::optional<size_t> take(std::vector<Queue>& queues, const size_t self) {
+		{
+			Queue& own = queues[self];
+			const std::lock_guard lock(own.mutex);
+			if (!own.jobs.empty()) {
+				const size_t job = own.jobs.back();
+				own.jobs.pop_back();
+				return job;
+			}
+		}
+		for (size_t k = 1; k < queues.size(); k++) {
+			Queue& victim = queues[(self + k) % queues.size()];
+			const std::lock_guard lock(victim.mutex);
+			if (!victim.jobs.empty()) {
+				const size_t job = victim.jobs.front();
+				victim.jobs.pop_front();
+				return job;
+			}
+		}
+		return std::nullopt;
+	}
+};
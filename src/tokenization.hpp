@@ -1,8 +1,16 @@
 #pragma once
 
+#include <array>
+#include <cassert>
+#include <iostream>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "./scan.hpp"
+#include "./symbols.hpp"
+
 enum class TokenType {
 	exit,
 	int_lit,
@@ -24,12 +32,17 @@ enum class TokenType {
 	from,
 	to,
 	function,
+	_return,
 	comma
 };
 
+inline constexpr size_t num_token_types = static_cast<size_t>(TokenType::comma) + 1;
+
 struct Token {
 	TokenType type;
-	std::optional<std::string> value {};
+	std::optional<std::string_view> value {};
+	// Interned id of an ident token, assigned by the Parser as it consumes it.
+	SymbolId symbol = no_symbol;
 };
 
 std::optional<int> bin_prec(TokenType type) {
@@ -45,112 +58,190 @@ std::optional<int> bin_prec(TokenType type) {
 	}
 }
 
+// Punctuation bytes map straight to their TokenType; character classes
+// live in scan.hpp next to the run-scanning kernels.
+inline constexpr std::array<TokenType, 256> punct_types = [] {
+	std::array<TokenType, 256> table {};
+	table['('] = TokenType::open_paren;
+	table[')'] = TokenType::close_paren;
+	table['{'] = TokenType::open_brace;
+	table['}'] = TokenType::close_brace;
+	table[';'] = TokenType::semi;
+	table['+'] = TokenType::plus;
+	table['-'] = TokenType::minus;
+	table['*'] = TokenType::star;
+	table['/'] = TokenType::fslash;
+	table['='] = TokenType::eq;
+	table[','] = TokenType::comma;
+	return table;
+}();
+
+// Perfect hash over the keyword set: every keyword lands in its own slot, so
+// a word is classified with one hash and at most one string comparison.
+struct Keyword {
+	std::string_view text;
+	TokenType type = TokenType::ident;
+};
+
+inline constexpr std::array<Keyword, 9> keywords { {
+	{ "exit", TokenType::exit },
+	{ "let", TokenType::let },
+	{ "if", TokenType::_if },
+	{ "for", TokenType::_for },
+	{ "from", TokenType::from },
+	{ "to", TokenType::to },
+	{ "print", TokenType::print },
+	{ "function", TokenType::function },
+	{ "return", TokenType::_return },
+} };
+
+inline constexpr size_t keyword_min_len = 2;
+inline constexpr size_t keyword_max_len = 8;
+
+[[nodiscard]] inline constexpr size_t keyword_hash(const std::string_view word) {
+	return (word.size() + static_cast<unsigned char>(word[0]) + (static_cast<unsigned char>(word[1]) << 3)) & 15;
+}
+
+inline constexpr std::array<Keyword, 16> keyword_table = [] {
+	std::array<Keyword, 16> table {};
+	for (const Keyword& keyword : keywords) {
+		table[keyword_hash(keyword.text)] = keyword;
+	}
+	return table;
+}();
+
+static_assert([] {
+	for (const Keyword& keyword : keywords) {
+		if (keyword_table[keyword_hash(keyword.text)].text != keyword.text) {
+			return false;
+		}
+	}
+	return true;
+}(), "keyword_hash has collisions");
+
+[[nodiscard]] inline constexpr TokenType classify_word(const std::string_view word) {
+	if (word.size() < keyword_min_len || word.size() > keyword_max_len) {
+		return TokenType::ident;
+	}
+	const Keyword& slot = keyword_table[keyword_hash(word)];
+	return slot.text == word ? slot.type : TokenType::ident;
+}
+
 class Tokenizer {
 public:
-	inline explicit Tokenizer(std::string src)
-		: m_src(std::move(src)) { }
+	inline explicit Tokenizer(std::string_view src, const ScanKernel kernel = detect_scan_kernel())
+		: m_src(src)
+		, m_scanner(scanner_for(kernel)) { }
 
 	inline std::vector<Token> tokenize() {
 		std::vector<Token> tokens;
-		std::string buf;
-		while (peek().has_value()) {
-			if (std::isalpha(peek().value())) {
-				buf.push_back(consume());
-				while (peek().has_value() && std::isalnum(peek().value())) {
-					buf.push_back(consume());
-				}
-				if (buf == "exit") {
-					tokens.push_back(Token{TokenType::exit });
-					buf.clear();
-				} else if (buf == "let") {
-					tokens.push_back(Token{TokenType::let });
-					buf.clear();
-				} else if (buf == "if") {
-					tokens.push_back(Token{TokenType::_if });
-					buf.clear();
-				} else if (buf == "for") {
-					tokens.push_back(Token{TokenType::_for });
-					buf.clear();
-				} else if (buf == "from") {
-					tokens.push_back(Token{TokenType::from });
-					buf.clear();
-				} else if (buf == "to") {
-					tokens.push_back(Token{TokenType::to });
-					buf.clear();
-				} else if (buf == "print") {
-					tokens.push_back(Token{TokenType::print });
-					buf.clear();
-				} else if (buf == "function") {
-					tokens.push_back(Token{TokenType::function });
-					buf.clear();
-				} else {
-					tokens.push_back(Token{TokenType::ident, buf });
-					buf.clear();
-				}
-			} else if (std::isdigit(peek().value())) {
-				buf.push_back(consume());
-				while (peek().has_value() && std::isdigit(peek().value())) {
-					buf.push_back(consume());
+		// Typical sources average well over 8 bytes per token; reserving up
+		// front avoids repeatedly copying a vector of millions of tokens.
+		tokens.reserve(m_src.size() / 8);
+		while (auto token = next()) {
+			tokens.push_back(token.value());
+		}
+		m_index = 0;
+		return tokens;
+	}
+
+	// Lexes a single token, or returns nothing at end of input.
+	inline std::optional<Token> next() {
+		const char* const src = m_src.data();
+		const size_t size = m_src.size();
+		while (m_index < size) {
+			const char c = src[m_index];
+			switch (char_class(c)) {
+			case CharClass::space:
+				m_index = m_scanner.skip_space(src, m_index + 1, size);
+				break;
+			case CharClass::alpha: {
+				const size_t start = m_index;
+				m_index = m_scanner.skip_ident(src, m_index + 1, size);
+				const std::string_view buf = m_src.substr(start, m_index - start);
+				const TokenType type = classify_word(buf);
+				if (type == TokenType::ident) {
+					return Token{TokenType::ident, buf };
 				}
-				tokens.push_back(Token{TokenType::int_lit, buf });
-				buf.clear();
-			} else if (peek().value() == '(') {
-				consume();
-				tokens.push_back(Token{TokenType::open_paren });
-			} else if (peek().value() == ')') {
-				consume();
-				tokens.push_back(Token{TokenType::close_paren });
-			} else if (peek().value() == '{') {
-				consume();
-				tokens.push_back(Token{TokenType::open_brace });
-			} else if (peek().value() == '}') {
-				consume();
-				tokens.push_back(Token{TokenType::close_brace });
-			} else if (peek().value() == ';') {
-				consume();
-				tokens.push_back(Token{TokenType::semi });
-			} else if (peek().value() == '+') {
-				consume();
-				tokens.push_back(Token{TokenType::plus });
-			} else if (peek().value() == '-') {
-				consume();
-				tokens.push_back(Token{TokenType::minus });
-			} else if (peek().value() == '*') {
-				consume();
-				tokens.push_back(Token{TokenType::star });
-			} else if (peek().value() == '/') {
-				consume();
-				tokens.push_back(Token{TokenType::fslash });
-			} else if (peek().value() == '=') {
-				consume();
-				tokens.push_back(Token{TokenType::eq });
-			} else if (peek().value() == ',') {
-				consume();
-				tokens.push_back(Token{TokenType::comma });
-			} else if (std::isspace(peek().value())) {
-				consume();
-			} else {
-				std::cerr << "Unknown token " << peek().value() << std::endl;
+				return Token{type };
+			}
+			case CharClass::digit: {
+				const size_t start = m_index;
+				m_index = m_scanner.skip_digits(src, m_index + 1, size);
+				return Token{TokenType::int_lit, m_src.substr(start, m_index - start) };
+			}
+			case CharClass::punct:
+				m_index++;
+				return Token{punct_types[static_cast<unsigned char>(c)] };
+			case CharClass::invalid:
+				std::cerr << "Unknown token " << c << std::endl;
 				exit(EXIT_FAILURE);
 			}
 		}
-		m_index = 0;
-		return tokens;
+		return {};
 	}
 
 private:
-	[[nodiscard]] inline std::optional<char> peek(int offset = 0) const {
-		if (m_index + offset >= m_src.length()) {
-			return {};
-		} else {
-			return m_src.at(m_index + offset);
+	const std::string_view m_src;
+	const Scanner& m_scanner;
+	size_t m_index = 0;
+};
+
+// Token source for the Parser. Tokens are either pulled lazily from a
+// Tokenizer or read from an already tokenized vector; in both cases only
+// the lookahead window lives in the ring buffer, so streaming memory stays
+// flat regardless of the source size.
+class TokenStream {
+public:
+	static constexpr size_t max_lookahead = 4;
+
+	inline explicit TokenStream(Tokenizer& tokenizer)
+		: m_tokenizer(&tokenizer) { }
+
+	inline explicit TokenStream(std::vector<Token> tokens)
+		: m_tokens(std::move(tokens)) { }
+
+	// The returned token stays valid until it is consumed.
+	[[nodiscard]] inline const Token* peek(const size_t offset = 0) {
+		assert(offset < max_lookahead);
+		while (m_count <= offset) {
+			std::optional<Token> token = pull();
+			if (!token.has_value()) {
+				return nullptr;
+			}
+			m_ring[(m_head + m_count) % max_lookahead] = token.value();
+			m_count++;
 		}
+		return &m_ring[(m_head + offset) % max_lookahead];
 	}
 
-	inline char consume() {
-		return m_src.at(m_index++);
+	inline Token consume() {
+		if (m_count == 0) {
+			std::optional<Token> token = pull();
+			assert(token.has_value());
+			return token.value();
+		}
+		const Token token = m_ring[m_head];
+		m_head = (m_head + 1) % max_lookahead;
+		m_count--;
+		return token;
 	}
 
-	const std::string m_src;
-	size_t m_index = 0;
+private:
+	inline std::optional<Token> pull() {
+		if (m_tokenizer != nullptr) {
+			return m_tokenizer->next();
+		}
+		if (m_next < m_tokens.size()) {
+			return m_tokens[m_next++];
+		}
+		return {};
+	}
+
+	Tokenizer* m_tokenizer = nullptr;
+	std::vector<Token> m_tokens {};
+	size_t m_next = 0;
+	std::array<Token, max_lookahead> m_ring {};
+	size_t m_head = 0;
+	size_t m_count = 0;
 };
\ No newline at end of file
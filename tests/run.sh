@@ -0,0 +1,33 @@
+#!/bin/sh
+# Runs every tests/<name>.me with --run under each code generator and diffs
+# what the program prints, and its exit code, against tests/<name>.out.
+#
+#   tests/run.sh <path to mine>
+
+set -u
+
+if [ $# -ne 1 ]; then
+	echo "usage: $0 <path to mine>" >&2
+	exit 2
+fi
+mine=$1
+dir=$(dirname "$0")
+
+failed=0
+for input in "$dir"/*.me; do
+	expected="${input%.me}.out"
+	for mode in "" --stack-exprs --ir --jobs=4; do
+		# Drop the echoed source; keep what follows "Executing...".
+		actual=$("$mine" $mode --run "$input" 2>&1 | sed -n '/^Executing\.\.\. $/,$p' | sed 1d)
+		if ! printf '%s\n' "$actual" | diff -u "$expected" - >/dev/null; then
+			echo "FAIL $input ${mode:-(default)}"
+			printf '%s\n' "$actual" | diff -u "$expected" -
+			failed=1
+		fi
+	done
+done
+
+if [ $failed -eq 0 ]; then
+	echo "all tests passed"
+fi
+exit $failed